@@ -7,10 +7,15 @@
 #include "frametable.h"
 #include "process.h"
 #include "file.h"
+#include "vnode.h"
+#include "mapping.h"
+#include "share_vm.h"
 #include "sos.h"
+#include "vmem_layout.h"
 #include <sys/panic.h>
 
 #define PAGE_ENTRIES 1024
+#define REGION_INDEX_MIN 8
 
 extern struct PCB *curproc;
 extern struct oft_entry of_table[MAX_OPEN_FILE];
@@ -32,8 +37,20 @@ struct app_addrspace *as_new() {
 
     /* Initialise addrspace variables */
     as->regions = NULL;
+    as->region_index = NULL;
+    as->region_count = 0;
+    as->region_capacity = 0;
+    as->last_region = NULL;
     as->page_table = NULL;
     as->page_count = 0;
+    as->rss = 0;
+    as->rss_limit = 0;
+    as->page_ins = 0;
+    as->ws_page_ins = 0;
+    as->ws_target = 0;
+    as->fault_count = 0;
+    as->next_fault = 0;
+    as->fault_window = 0;
 
     /* File descriptors */
     /* STDIN and STDERR */
@@ -48,10 +65,40 @@ struct app_addrspace *as_new() {
     return as;
 }
 
+/* Position of the last region starting at or below uaddr, -1 if there is none */
+static int region_search(struct app_addrspace *as, seL4_Word uaddr) {
+    int low = 0;
+    int high = (int) as->region_count - 1;
+    int found = -1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (as->region_index[mid]->baseaddr <= uaddr) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return found;
+}
+
 int as_define_region(struct app_addrspace *as,
         seL4_Word baseaddr,
         seL4_Word size,
         seL4_Word permissions) {
+    if (as->region_count == as->region_capacity) {
+        /* Grow the index */
+        seL4_Word capacity = as->region_capacity ? as->region_capacity * 2 : REGION_INDEX_MIN;
+        struct region **index = realloc(as->region_index, capacity * sizeof(struct region *));
+        if (index == NULL) {
+            return -1;
+        }
+        as->region_index = index;
+        as->region_capacity = capacity;
+    }
+
     struct region *new_region = malloc(sizeof(struct region));
     if (new_region == NULL) {
         return -1;
@@ -61,6 +108,11 @@ int as_define_region(struct app_addrspace *as,
     new_region->baseaddr = baseaddr;
     new_region->size = size;
     new_region->permissions = permissions;
+    new_region->flags = 0;
+    new_region->vnode = NULL;
+    new_region->file_offset = 0;
+    new_region->image = NULL;
+    new_region->file_size = 0;
 
     /* Add to addrspace region list */
     if (as->regions == NULL) {
@@ -71,51 +123,366 @@ int as_define_region(struct app_addrspace *as,
         as->regions = new_region;
     }
 
+    /* Keep the index sorted */
+    int pos = region_search(as, baseaddr) + 1;
+    for (int i = as->region_count; i > pos; i--) {
+        as->region_index[i] = as->region_index[i - 1];
+    }
+    as->region_index[pos] = new_region;
+    as->region_count++;
+
     return 0;
 }
 
+void as_set_region_flags(struct app_addrspace *as, seL4_Word baseaddr, seL4_Word flags) {
+    struct region *curr_region = as->regions;
+    while (curr_region != NULL) {
+        if (curr_region->baseaddr == baseaddr) {
+            curr_region->flags = flags;
+            return;
+        }
+        curr_region = curr_region->next;
+    }
+}
+
+/*
+ * Back a region with part of a file, its pages are read in when first touched
+ * Note: The region takes over the caller's read reference to the vnode
+ */
+void as_set_region_file(struct app_addrspace *as, seL4_Word baseaddr,
+        struct vnode *vnode, seL4_Word file_offset, seL4_Word file_size) {
+    struct region *curr_region = as->regions;
+    while (curr_region != NULL) {
+        if (curr_region->baseaddr == baseaddr) {
+            curr_region->vnode = vnode;
+            curr_region->file_offset = file_offset;
+            curr_region->file_size = file_size;
+            return;
+        }
+        curr_region = curr_region->next;
+    }
+}
+
+/*
+ * Back a region with contents already in memory as part of SOS's image,
+ * read-only pages are mapped straight from it and the rest copied when first touched
+ */
+void as_set_region_image(struct app_addrspace *as, seL4_Word baseaddr,
+        char *image, seL4_Word file_size) {
+    struct region *curr_region = as->regions;
+    while (curr_region != NULL) {
+        if (curr_region->baseaddr == baseaddr) {
+            curr_region->image = image;
+            curr_region->file_size = file_size;
+            return;
+        }
+        curr_region = curr_region->next;
+    }
+}
+
+/* Lowest free range of size bytes between start and end, 0 if there is none */
+seL4_Word as_find_free(struct app_addrspace *as, seL4_Word start, seL4_Word end, seL4_Word size) {
+    seL4_Word base = start;
+
+    for (seL4_Word i = 0; i < as->region_count; i++) {
+        struct region *region = as->region_index[i];
+        if (region->baseaddr + region->size <= base) continue;
+        if (region->baseaddr >= base + size) break;
+
+        /* Overlaps, try just past it */
+        base = PAGE_ALIGN_4K(region->baseaddr + region->size + PAGE_SIZE_4K - 1);
+    }
+
+    if (base + size < base || base + size > end) return 0;
+    return base;
+}
+
+/* Mode the region's file reference was opened with, written back regions write to it too */
+int as_region_file_mode(struct region *region) {
+    if (region->flags & REGION_WRITEBACK) return FM_READ | FM_WRITE;
+    return FM_READ;
+}
+
 struct region *get_region(seL4_Word uaddr) {
-    struct region *curr_region = curproc->addrspace->regions;
+    return as_get_region(curproc->addrspace, uaddr);
+}
+
+struct region *as_get_region(struct app_addrspace *as, seL4_Word uaddr) {
+    /* Faults and syscalls tend to hit the same region repeatedly */
+    struct region *curr_region = as->last_region;
+    if (curr_region != NULL &&
+            curr_region->baseaddr <= uaddr &&
+            curr_region->baseaddr + curr_region->size > uaddr) {
+        return curr_region;
+    }
+
+    int pos = region_search(as, uaddr);
+    if (pos < 0) return NULL;
+
+    curr_region = as->region_index[pos];
+    if (curr_region->baseaddr + curr_region->size <= uaddr) return NULL;
+
+    as->last_region = curr_region;
+    return curr_region;
+}
+
+/*
+ * Copy parent's addrspace into child for a fork
+ * Note: Pages are shared copy-on-write, nothing is copied until written.
+ *       Written back file mappings are not inherited, only the process
+ *       that mapped them writes to the file.
+ */
+int as_clone(struct PCB *parent, struct PCB *child) {
+    struct app_addrspace *parent_as = parent->addrspace;
+    struct app_addrspace *child_as = child->addrspace;
+    int err;
+
+    /* Regions (the IPC buffer is already defined for the child) */
+    struct region *curr_region = parent_as->regions;
     while (curr_region != NULL) {
-        if (curr_region->baseaddr <= uaddr &&
-                curr_region->baseaddr + curr_region->size > uaddr) {
-            return curr_region;
+        if (curr_region->baseaddr != PROCESS_IPC_BUFFER && (curr_region->flags & REGION_WRITEBACK) == 0) {
+            err = as_define_region(child_as,
+                    curr_region->baseaddr,
+                    curr_region->size,
+                    curr_region->permissions);
+            if (err) return -1;
+
+            as_set_region_flags(child_as, curr_region->baseaddr, curr_region->flags);
+
+            /* Untouched pages are read from the same file */
+            if (curr_region->vnode != NULL) {
+                struct vnode *vnode;
+                err = vfs_open(curr_region->vnode->path, as_region_file_mode(curr_region), &vnode);
+                if (err) return -1;
+
+                as_set_region_file(child_as,
+                        curr_region->baseaddr,
+                        vnode,
+                        curr_region->file_offset,
+                        curr_region->file_size);
+            }
+
+            if (curr_region->image != NULL) {
+                as_set_region_image(child_as,
+                        curr_region->baseaddr,
+                        curr_region->image,
+                        curr_region->file_size);
+            }
         }
         curr_region = curr_region->next;
     }
 
-    return NULL;
+    /* File descriptors refer to the same open files */
+    for (int fd = 0; fd < PROCESS_MAX_FILES; fd++) {
+        if (child_as->fd_table[fd].ofd != -1) {
+            of_close(child_as->fd_table[fd].ofd);
+        }
+
+        seL4_Word ofd = parent_as->fd_table[fd].ofd;
+        child_as->fd_table[fd].ofd = ofd;
+        if (ofd != -1) {
+            of_table[ofd].ref_count++;
+        }
+    }
+    child_as->fd_count = parent_as->fd_count;
+
+    /* Pages */
+    if (parent_as->page_table == NULL) return 0;
+
+    for (int i = 0; i < PAGE_ENTRIES; i++) {
+
+        /* Note: The parent may fault in page tables while we yield */
+        if (parent_as->page_table[i] == NULL) continue;
+
+        for (int j = 0; j < PAGE_ENTRIES; j++) {
+            seL4_Word uaddr = (i << 22) | (j << 12);
+            if (uaddr >= PROCESS_IPC_BUFFER) break;
+
+            struct region *region = as_get_region(parent_as, uaddr);
+            if (region != NULL && (region->flags & REGION_WRITEBACK)) continue;
+
+            err = share_fork_page(uaddr, parent, child);
+            if (err) return -1;
+        }
+    }
+
+    return 0;
 }
 
-int as_destroy(struct app_addrspace *as) {
-    if (as == NULL) return -1;
+/* Free the frame or slot backing the page at uaddr, the entry is left for the caller */
+static void as_free_page(struct app_addrspace *as, seL4_Word uaddr) {
+    seL4_Word pte = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+
+    if (pte & (PTE_ZERO | PTE_IMAGE)) {
+        sos_unmap_zero_page(uaddr, as);
+    } else if (pte & PTE_LARGE) {
+        /* The whole large frame goes with its first piece */
+        if (leaf_index(uaddr) % LARGE_PAGE_FRAMES == 0) {
+            seL4_Word sos_vaddr = PAGE_ALIGN_4K(pte);
+            sos_unmap_page(sos_vaddr, as);
+            frame_free(sos_vaddr);
+        }
+    } else if (pte & PTE_SHARED) {
+        /* The share owns the frame and slot */
+        if ((pte & PTE_SWAP) == 0) {
+            sos_unmap_page(PAGE_ALIGN_4K(pte), as);
+        }
+        share_leave(uaddr, as);
+    } else if (pte & PTE_VALID) {
+        if (pte & PTE_BEINGSWAPPED) {
+            /* Frame and slot are still with the swapper, it cleans up once done */
+        } else if (pte & PTE_SWAP) {
+            free_swap_index(pte_index(pte));
+        } else {
+            seL4_Word sos_vaddr = PAGE_ALIGN_4K(pte);
+            sos_unmap_page(sos_vaddr, as);
+            frame_free(sos_vaddr);
+            seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
+        }
+    }
+}
+
+/*
+ * Shrink a region to size bytes, unmapping and freeing the pages past its new end
+ * Note: Pages still being written out are waited for, the swapper would
+ *       otherwise hand them back to the page table afterwards. A large
+ *       frame across the new end is split first.
+ */
+int as_trim_region(struct PCB *pcb, struct region *region, seL4_Word size) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word start = PAGE_ALIGN_4K(region->baseaddr + size + PAGE_SIZE_4K - 1);
+    seL4_Word end = PAGE_ALIGN_4K(region->baseaddr + region->size + PAGE_SIZE_4K - 1);
+    int err;
+
+    if (start < end && PAGE_ALIGN_LARGE(start) != start) {
+        err = sos_split_page(start, pcb);
+        if (err) return -1;
+    }
+
+    for (seL4_Word uaddr = start; as->page_table != NULL && uaddr < end; uaddr += PAGE_SIZE_4K) {
+        if (as->page_table[root_index(uaddr)] == NULL) continue;
+
+        struct page_table_entry *pte = &as->page_table[root_index(uaddr)][leaf_index(uaddr)];
+
+        /* Note: Afterwards the entry holds its slot, the frame if the write failed, or nothing */
+        sos_wait_page(uaddr, pcb);
+
+        if ((pte->sos_vaddr & PTE_VALID) == 0) continue;
+        if ((pte->sos_vaddr & (PTE_ZERO | PTE_IMAGE)) == 0) as->page_count--;
+
+        as_free_page(as, uaddr);
+        pte->sos_vaddr = 0;
+    }
+
+    region->size = size;
+    if (region->file_size > size) region->file_size = size;
+
+    /* Page table pages left with no entries */
+    for (int index1 = root_index(start); as->page_table != NULL && start < end && index1 <= root_index(end - 1); index1++) {
+        if (as->page_table[index1] == NULL) continue;
+
+        int used = 0;
+        for (int j = 0; j < PAGE_ENTRIES && !used; j++) {
+            used = (as->page_table[index1][j].sos_vaddr != 0);
+        }
+        if (used) continue;
+
+        frame_free(PAGE_ALIGN_4K((seL4_Word) as->page_table[index1]));
+        as->page_table[index1] = NULL;
+    }
+
+    return 0;
+}
 
+/*
+ * Split region at the page aligned address at inside it, from at on it becomes a region of its own
+ * Note: The pages stay mapped, their entries now belong to the new region
+ */
+int as_split_region(struct PCB *pcb, struct region *region, seL4_Word at) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word offset = at - region->baseaddr;
     int err;
 
-    /* Free page table and swap table */
+    /* A large frame can not straddle two regions */
+    if (PAGE_ALIGN_LARGE(at) != at) {
+        err = sos_split_page(at, pcb);
+        if (err) return -1;
+    }
+
+    struct vnode *vnode = NULL;
+    if (region->vnode != NULL) {
+        err = vfs_open(region->vnode->path, as_region_file_mode(region), &vnode);
+        if (err) return -1;
+    }
+
+    err = as_define_region(as, at, region->size - offset, region->permissions);
+    if (err) {
+        if (vnode != NULL) vfs_close(vnode, as_region_file_mode(region));
+        return -1;
+    }
+
+    /* Note: New regions go at the head of the list */
+    struct region *tail = as->regions;
+    tail->flags = region->flags;
+    tail->vnode = vnode;
+    tail->file_offset = region->file_offset + offset;
+    tail->image = (region->image != NULL) ? region->image + offset : NULL;
+    tail->file_size = (region->file_size > offset) ? region->file_size - offset : 0;
+
+    region->size = offset;
+    if (region->file_size > offset) region->file_size = offset;
+
+    return 0;
+}
+
+/* Unmap and free every page of a region, then forget the region */
+int as_remove_region(struct PCB *pcb, struct region *region) {
+    struct app_addrspace *as = pcb->addrspace;
+
+    int err = as_trim_region(pcb, region, 0);
+    if (err) return -1;
+
+    /* Unlink from the list and the index */
+    struct region **link = &as->regions;
+    while (*link != region) {
+        link = &(*link)->next;
+    }
+    *link = region->next;
+
+    /* Note: A zero size region may share the base address, so look for the region itself */
+    seL4_Word pos = 0;
+    while (as->region_index[pos] != region) {
+        pos++;
+    }
+    for (seL4_Word i = pos; i + 1 < as->region_count; i++) {
+        as->region_index[i] = as->region_index[i + 1];
+    }
+    as->region_count--;
+
+    if (as->last_region == region) as->last_region = NULL;
+
+    if (region->vnode != NULL) {
+        vfs_close(region->vnode, as_region_file_mode(region));
+    }
+    free(region);
+
+    return 0;
+}
+
+int as_destroy(struct app_addrspace *as) {
+    if (as == NULL) return -1;
+
+    /* Free page table */
     for (int i = 0; i < PAGE_ENTRIES; i++) {
 
         if (as->page_table[i] == NULL) continue;
 
         for (int j = 0; j < PAGE_ENTRIES; j++) {
-
-            if (as->page_table[i][j].sos_vaddr & PTE_VALID) {
-                if (as->page_table[i][j].sos_vaddr & PTE_SWAP) {
-                    free_swap_index(as->swap_table[i][j].swap_index);
-                } else {
-                    seL4_Word sos_vaddr = PAGE_ALIGN_4K(as->page_table[i][j].sos_vaddr);
-                    sos_unmap_page(sos_vaddr, as);
-                    frame_free(sos_vaddr);
-                    seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
-                }
-            }
+            as_free_page(as, (i << 22) | (j << 12));
         }
 
-        /* Note: We are guarenteed to already have the swap_table page allocated if the page_table page exist */
-        frame_free(PAGE_ALIGN_4K((seL4_Word) as->swap_table[i]));
         frame_free(PAGE_ALIGN_4K((seL4_Word) as->page_table[i]));
     }
-    frame_free(PAGE_ALIGN_4K((seL4_Word) as->swap_table));
     frame_free(PAGE_ALIGN_4K((seL4_Word) as->page_table));
 
     /* Free regions */
@@ -123,8 +490,12 @@ int as_destroy(struct app_addrspace *as) {
     while (curr != NULL) {
         struct region *to_free = curr;
         curr = curr->next;
+        if (to_free->vnode != NULL) {
+            vfs_close(to_free->vnode, as_region_file_mode(to_free));
+        }
         free(to_free);
     }
+    free(as->region_index);
 
     /* Close files */
     for (int fd = 0; fd < PROCESS_MAX_FILES; fd++) {
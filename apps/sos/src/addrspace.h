@@ -4,20 +4,52 @@
 #define PTE_VALID (1 << 3)
 #define PTE_SWAP (1 << 4)
 #define PTE_BEINGSWAPPED (1 << 5)
+#define PTE_SOFT (1 << 6)
+#define PTE_SHARED (1 << 7)
+#define PTE_LARGE (1 << 8)
+#define PTE_ZERO (1 << 9)
+#define PTE_IMAGE (1 << 10)
+
+#define PTE_INDEX_SHIFT 12
+#define PTE_FLAGS_MASK ((1 << PTE_INDEX_SHIFT) - 1)
+
+/* Region flags */
+#define REGION_LARGE_PAGES (1 << 0) /* Back aligned 64K blocks with large frames */
+#define REGION_ANONYMOUS (1 << 1) /* Untouched pages read as zero */
+#define REGION_MMAP (1 << 2) /* Made by sos_mmap, can be unmapped */
+#define REGION_WRITEBACK (1 << 3) /* Written pages go back to the file instead of the pagefile */
 
 struct app_addrspace {
     seL4_Word fd_count;
     seL4_Word page_count;
+    seL4_Word rss; /* Frames owned, counted against rss_limit */
+    seL4_Word rss_limit; /* 0 for no limit */
+    seL4_Word page_ins; /* Pages brought in by faults, the demand measured by the working set manager */
+    seL4_Word ws_page_ins; /* page_ins at the last working set sample */
+    seL4_Word ws_target; /* Frames the working set manager allows, 0 until first sampled */
+    seL4_Word fault_count; /* Virtual time used for working set ageing */
+    seL4_Word next_fault; /* Page after the last fault-around window */
+    seL4_Word fault_window; /* Pages to map ahead of the next sequential fault */
     struct region *regions;
+    struct region **region_index; /* Regions sorted by base address */
+    seL4_Word region_count;
+    seL4_Word region_capacity;
+    struct region *last_region; /* Last region found by as_get_region */
     struct fdt_entry *fd_table;
     struct page_table_entry **page_table;
-    struct swap_table_entry **swap_table;
 };
 
+struct vnode;
+
 struct region {
     seL4_Word baseaddr;
     seL4_Word size;
     seL4_Word permissions;
+    seL4_Word flags;
+    struct vnode *vnode; /* File the region's pages are read from on first touch, NULL for none */
+    seL4_Word file_offset; /* Offset in the file of baseaddr */
+    char *image; /* Contents in SOS's own image (the cpio archive) at baseaddr, NULL for none */
+    seL4_Word file_size; /* Bytes from baseaddr that come from the file or image, the rest reads as zero */
     struct region *next;
 };
 
@@ -25,12 +57,16 @@ struct fdt_entry {
     seL4_Word ofd;
 };
 
-struct swap_table_entry {
-    seL4_Word swap_index;
-};
-
 /*
- *VFN|UNUSED|S|V|P|
+ *VFN|UNUSED|I|Z|L|H|F|B|S|V|P|
+ *VFN:Frame address while resident. Once swapped out (S set and B clear)
+ *    it holds the pagefile slot instead, or the share id for shared pages
+ *I:Image bit - a frame of SOS's image is mapped read-only, VFN holds the cap of the mapping
+ *Z:Zero bit - the shared zero frame is mapped read-only, VFN holds the cap of the mapping
+ *L:Large bit - one of the 16 pieces of a 64K large frame mapping
+ *H:Shared bit - frame and swap slot are tracked by the share, not this entry
+ *F:Soft bit - frame is resident but unmapped to sample the reference bit
+ *B:Being swapped bit
  *S:Swap bit
  *V:Valid bit
  *P:Permission 3bits same as elf_permission
@@ -49,18 +85,51 @@ int as_define_region(struct app_addrspace *as,
         seL4_Word size,
         seL4_Word permissions);
 
+void as_set_region_flags(struct app_addrspace *as, seL4_Word baseaddr, seL4_Word flags);
+
+void as_set_region_file(struct app_addrspace *as, seL4_Word baseaddr,
+        struct vnode *vnode, seL4_Word file_offset, seL4_Word file_size);
+
+void as_set_region_image(struct app_addrspace *as, seL4_Word baseaddr,
+        char *image, seL4_Word file_size);
+
+seL4_Word as_find_free(struct app_addrspace *as, seL4_Word start, seL4_Word end, seL4_Word size);
+
+int as_region_file_mode(struct region *region);
+
 struct region *get_region(seL4_Word uaddr);
 
+struct region *as_get_region(struct app_addrspace *as, seL4_Word uaddr);
+
+struct PCB;
+
+int as_clone(struct PCB *parent, struct PCB *child);
+
+int as_split_region(struct PCB *pcb, struct region *region, seL4_Word at);
+
+int as_trim_region(struct PCB *pcb, struct region *region, seL4_Word size);
+
+int as_remove_region(struct PCB *pcb, struct region *region);
+
 int as_destroy(struct app_addrspace *as);
 
-/* Root index to page table / swap table */
+/* Root index to page table */
 inline int root_index(seL4_Word uaddr) {
     return (uaddr >> 22);
 }
 
-/* Leaf index to page table / swap table */
+/* Leaf index to page table */
 inline int leaf_index(seL4_Word uaddr) {
     return ((uaddr << 10) >> 22);
 }
 
+/* Slot or share id kept in place of the frame address */
+inline uint32_t pte_index(seL4_Word pte) {
+    return (pte >> PTE_INDEX_SHIFT);
+}
+
+inline seL4_Word pte_set_index(seL4_Word pte, uint32_t index) {
+    return ((index << PTE_INDEX_SHIFT) | (pte & PTE_FLAGS_MASK));
+}
+
 #endif /* _ADDRSPACE_H_ */
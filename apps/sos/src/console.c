@@ -10,6 +10,7 @@
 #include "console.h"
 #include "coroutine.h"
 #include "process.h"
+#include "frametable.h"
 #include <sys/debug.h>
 #include <sys/panic.h>
 
@@ -110,9 +111,9 @@ static int console_write(struct vnode *vnode, struct uio *uio) {
         }
 
         /* Although we can assume the buffer is mapped because it is a write operation,
-         * we still use sos_map_page to find the mapping address if it is already mapped */
+         * we still use sos_map_page_read to find the mapping address if it is already mapped */
         seL4_Word sos_vaddr;
-        int err = sos_map_page(uaddr, &sos_vaddr, curproc);
+        int err = sos_map_page_read(uaddr, &sos_vaddr, curproc);
         if (err && err != ERR_ALREADY_MAPPED) return -1;
         
         sos_vaddr = PAGE_ALIGN_4K(sos_vaddr);
@@ -153,8 +154,9 @@ static int console_read(struct vnode *vnode, struct uio *uio) {
         }
 
         seL4_CPtr sos_vaddr;
-        int err = sos_map_page(curr_uaddr, &sos_vaddr, curproc);
-        if (err && err != ERR_ALREADY_MAPPED) {
+        /* The serial handler writes straight into the frame */
+        int err = sos_map_page_write(curr_uaddr, &sos_vaddr, curproc);
+        if (err) {
             return -1;
         }
 
@@ -36,24 +36,9 @@
 #define PAGE_ALIGN(addr) ((addr) & ~(PAGEMASK))
 #define IS_PAGESIZE_ALIGNED(addr) !((addr) & (PAGEMASK))
 
-#define LOWER_BITS_SHIFT 20
-
-/* To differencient between async and and sync IPC, we assign a
- * badge to the async endpoint. The badge that we receive will
- * be the bitwise 'OR' of the async endpoint badge and the badges
- * of all pending notifications. */
-#define IRQ_EP_BADGE (1 << (seL4_BadgeBits - 1))
-/* All badged IRQs set high bet, then we use uniq bits to
- * distinguish interrupt sources */
-#define IRQ_BADGE_NETWORK (1 << 0)
-#define IRQ_BADGE_TIMER (1 << 1)
-
 extern seL4_ARM_PageDirectory dest_as;
 
-extern jmp_buf syscall_loop_entry;
-extern seL4_CPtr _sos_ipc_ep_cap;
 extern struct PCB *curproc;
-extern int curr_coroutine_id;
 
 /*
  * Convert ELF permissions into seL4 permissions.
@@ -71,107 +56,82 @@ static inline seL4_Word get_sel4_rights_from_elf(unsigned long permissions) {
     return result;
 }
 
-static void first_process_mapping_loop(seL4_CPtr ep) {
-    seL4_Word badge;
-    seL4_Word label;
-    seL4_MessageInfo_t message;
-    while (1) {
-        message = seL4_Wait(ep, &badge);
-        label = seL4_MessageInfo_get_label(message);
-        if (badge & IRQ_EP_BADGE) {
-            /* Interrupt */
-            if (badge & IRQ_BADGE_NETWORK) {
-                network_irq();
-            }
-            if (badge & IRQ_BADGE_TIMER) {
-                timer_interrupt();
-            }
+/*
+ * Whether a loadable segment other than segment i reaches into the page starting at page.
+ */
+static int elf_page_shared(char *elf_file, int i, unsigned long page) {
+    int num_headers = elf_getNumProgramHeaders(elf_file);
 
-        }
+    for (int j = 0; j < num_headers; j++) {
+        if (j == i || elf_getProgramHeaderType(elf_file, j) != PT_LOAD) continue;
 
-        seL4_Word req_mask = get_routine_arg(curr_coroutine_id, 0);
-        if (req_mask == 0 || req_mask == -1) {
-            return;
-        }
+        unsigned long vaddr = elf_getProgramHeaderVaddr(elf_file, j);
+        unsigned long segment_size = elf_getProgramHeaderMemorySize(elf_file, j);
+        if (vaddr < page + PAGESIZE && vaddr + segment_size > page) return 1;
     }
+
+    return 0;
 }
 
 /*
- * Inject data into the given vspace.
- * TODO: Don't keep these pages mapped in
- *
- * Note: This should only be used to load the initial app
+ * Load the pages two segments share when their boundaries are not page aligned
+ * Note: Faulting on a page only fills in the bytes of the region that faulted, so
+ *       the page is mapped now and the other segments' bytes are copied in after.
+ *       The contents come from the archive if vnode is NULL.
  */
-static int cpio_elf_load_segment_into_vspace(seL4_ARM_PageDirectory dest_pd,
-        struct app_addrspace *dest_as,
-        char *src, unsigned long segment_size,
-        unsigned long file_size, unsigned long dst,
-        unsigned long permissions, struct PCB *pcb) {
-
-    /* Overview of ELF segment loading
-
-    dst: destination base virtual address of the segment being loaded
-    segment_size: obvious
-
-    So the segment range to "load" is [dst, dst + segment_size).
-
-    The content to load is either zeros or the content of the ELF
-    file itself, or both.
-
-    The split between file content and zeros is a follows.
-
-    File content: [dst, dst + file_size)
-    Zeros: [dst + file_size, dst + segment_size)
-
-    Note: if file_size == segment_size, there is no zero-filled region.
-    Note: if file_size == 0, the whole segment is just zero filled.
-
-    The code below relies on seL4's frame allocator already
-    zero-filling a newly allocated frame.
-
-    */
-
-    assert(file_size <= segment_size);
-
-    unsigned long pos;
-
-    /* We work a page at a time in the destination vspace. */
-    pos = 0;
-
-    while(pos < segment_size) {
-        seL4_Word sos_vaddr;
-        seL4_CPtr sos_cap, tty_cap;
-        int nbytes;
-        int err;
-
-        /* Map the frame into address space */
-        int reenter = setjmp(syscall_loop_entry);
-        cleanup_coroutine();
-        if (!reenter) {
-            start_coroutine(sos_map_page, dst, &sos_vaddr, pcb);
-        } else {
-            /* Check the mask to see if we are done with the loop */
-            seL4_Word req_mask = get_routine_arg(curr_coroutine_id, 0);
-            if (req_mask == -1) return -1;
-            if (req_mask) {
-                first_process_mapping_loop(_sos_ipc_ep_cap);
-                resume();
-            } else {
-                /* Now copy our data into the destination vspace. */
-                nbytes = PAGESIZE - (dst & PAGEMASK);
-                if (pos < file_size) {
-                    memcpy((void*) (sos_vaddr | ((dst << LOWER_BITS_SHIFT) >> LOWER_BITS_SHIFT)),
-                            (void*)src, MIN(nbytes, file_size - pos));
+static int elf_load_shared_pages(struct PCB *pcb, char *elf_file, struct vnode *vnode) {
+    int num_headers = elf_getNumProgramHeaders(elf_file);
+
+    for (int i = 0; i < num_headers; i++) {
+        if (elf_getProgramHeaderType(elf_file, i) != PT_LOAD) continue;
+
+        unsigned long segment_size = elf_getProgramHeaderMemorySize(elf_file, i);
+        if (segment_size == 0) continue;
+
+        unsigned long ends[2];
+        ends[0] = elf_getProgramHeaderVaddr(elf_file, i);
+        ends[1] = ends[0] + segment_size - 1;
+
+        for (int e = 0; e < 2; e++) {
+            unsigned long page = PAGE_ALIGN(ends[e]);
+            if (!elf_page_shared(elf_file, i, page)) continue;
+
+            /* Note: Fills in segment i's part of the page */
+            seL4_Word sos_vaddr;
+            int err = sos_map_page(ends[e], &sos_vaddr, pcb);
+            if (err == ERR_ALREADY_MAPPED) continue;
+            if (err) return err;
+            sos_vaddr = PAGE_ALIGN(sos_vaddr);
+
+            for (int j = 0; j < num_headers; j++) {
+                if (j == i || elf_getProgramHeaderType(elf_file, j) != PT_LOAD) continue;
+
+                unsigned long vaddr = elf_getProgramHeaderVaddr(elf_file, j);
+                unsigned long offset = elf_getProgramHeaderOffset(elf_file, j);
+                unsigned long start = (vaddr > page) ? vaddr : page;
+                unsigned long end = MIN(page + PAGESIZE, vaddr + elf_getProgramHeaderFileSize(elf_file, j));
+                if (start >= end) continue;
+
+                if (vnode == NULL) {
+                    memcpy((void *) (sos_vaddr + (start - page)), elf_file + offset + (start - vaddr), end - start);
+                    continue;
                 }
-                sos_cap = get_cap(sos_vaddr);
-
-                /* Not observable to I-cache yet so flush the frame */
-                seL4_ARM_Page_Unify_Instruction(sos_cap, 0, PAGESIZE);
 
-                pos += nbytes;
-                dst += nbytes;
-                src += nbytes;
+                struct uio uio = {
+                    .uaddr = NULL,
+                    .vaddr = sos_vaddr + (start - page),
+                    .size = end - start,
+                    .remaining = end - start,
+                    .offset = offset + (start - vaddr),
+                    .pcb = pcb
+                };
+
+                err = vnode->ops->vop_read(vnode, &uio);
+                if (err) return ERR_FILE_READ;
             }
+
+            /* Not observable to I-cache yet so flush the frame */
+            seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGESIZE);
         }
     }
 
@@ -207,7 +167,9 @@ int cpio_elf_load(seL4_ARM_PageDirectory dest_pd, struct PCB *pcb, char *elf_fil
         vaddr = elf_getProgramHeaderVaddr(elf_file, i);
         flags = elf_getProgramHeaderFlags(elf_file, i);
 
-        /* Copy it across into the vspace. */
+        if (file_size > segment_size) {
+            return seL4_InvalidArgument;
+        }
 
         /* Define region */
         err = as_define_region(dest_as, vaddr, segment_size, get_sel4_rights_from_elf(flags) & seL4_AllRights);
@@ -215,96 +177,15 @@ int cpio_elf_load(seL4_ARM_PageDirectory dest_pd, struct PCB *pcb, char *elf_fil
             return err;
         }
 
-        /* Load segment */
-        err = cpio_elf_load_segment_into_vspace(dest_pd,
-                dest_as,
-                source_addr,
-                segment_size,
-                file_size, vaddr,
-                get_sel4_rights_from_elf(flags) & seL4_AllRights,
-                pcb);
-        if (err) {
-            return err;
-        }
+        /* Nothing is copied now, read-only pages are mapped straight from the
+         * archive where it lines up and the rest are copied when first touched */
+        as_set_region_image(dest_as, vaddr, source_addr, file_size);
     }
 
-    return 0;
+    return elf_load_shared_pages(pcb, elf_file, NULL);
 }
 
 
-static int elf_load_segment_into_vspace(seL4_ARM_PageDirectory dest_pd,
-        struct app_addrspace *dest_as,
-        char *src, unsigned long segment_size,
-        unsigned long file_size, unsigned long dst,
-        unsigned long permissions, struct PCB *pcb,
-        struct vnode *vnode) {
-
-    /* Overview of ELF segment loading
-
-    dst: destination base virtual address of the segment being loaded
-    segment_size: obvious
-
-    So the segment range to "load" is [dst, dst + segment_size).
-
-    The content to load is either zeros or the content of the ELF
-    file itself, or both.
-
-    The split between file content and zeros is a follows.
-
-    File content: [dst, dst + file_size)
-    Zeros: [dst + file_size, dst + segment_size)
-
-    Note: if file_size == segment_size, there is no zero-filled region.
-    Note: if file_size == 0, the whole segment is just zero filled.
-
-    The code below relies on seL4's frame allocator already
-    zero-filling a newly allocated frame.
-
-    */
-
-    assert(file_size <= segment_size);
-
-    unsigned long pos;
-
-    /* We work a page at a time in the destination vspace. */
-    pos = 0;
-
-
-    while(pos < segment_size) {
-        seL4_Word sos_vaddr;
-        seL4_CPtr sos_cap, tty_cap;
-        int nbytes;
-        int err;
-
-        /* Map the frame into address space */
-        sos_map_page(dst, &sos_vaddr, pcb);
-        nbytes = PAGESIZE - (dst & PAGEMASK);
-        if (pos < file_size) {
-            struct uio uio = {
-                .uaddr = dst,
-                .vaddr = NULL,
-                .size = MIN(nbytes, file_size - pos),
-                .remaining = MIN(nbytes, file_size - pos),
-                .offset = src,
-                .pcb = pcb
-            };
-
-            int err = vnode->ops->vop_read(vnode, &uio);
-            if (err) return -1;
-        }
-        sos_cap = get_cap(sos_vaddr);
-
-        /* Not observable to I-cache yet so flush the frame */
-        seL4_ARM_Page_Unify_Instruction(sos_cap, 0, PAGESIZE);
-
-        pos += nbytes;
-        dst += nbytes;
-        src += nbytes;
-
-    }
-    return 0;
-}
-
 int elf_load(seL4_ARM_PageDirectory dest_pd, struct PCB *pcb, char *elf_file, struct vnode *vnode) {
 
     int num_headers;
@@ -320,21 +201,22 @@ int elf_load(seL4_ARM_PageDirectory dest_pd, struct PCB *pcb, char *elf_file, st
 
     num_headers = elf_getNumProgramHeaders(elf_file);
     for (i = 0; i < num_headers; i++) {
-        char *source_addr;
-        unsigned long flags, file_size, segment_size, vaddr;
+        unsigned long offset, flags, file_size, segment_size, vaddr;
 
         /* Skip non-loadable segments (such as debugging data). */
         if (elf_getProgramHeaderType(elf_file, i) != PT_LOAD)
             continue;
 
         /* Fetch information about this segment. */
-        source_addr =  elf_getProgramHeaderOffset(elf_file, i);
+        offset = elf_getProgramHeaderOffset(elf_file, i);
         file_size = elf_getProgramHeaderFileSize(elf_file, i);
         segment_size = elf_getProgramHeaderMemorySize(elf_file, i);
         vaddr = elf_getProgramHeaderVaddr(elf_file, i);
         flags = elf_getProgramHeaderFlags(elf_file, i);
 
-        /* Copy it across into the vspace. */
+        if (file_size > segment_size) {
+            return seL4_InvalidArgument;
+        }
 
         /* Define region */
         err = as_define_region(dest_as, vaddr, segment_size, get_sel4_rights_from_elf(flags) & seL4_AllRights);
@@ -342,19 +224,14 @@ int elf_load(seL4_ARM_PageDirectory dest_pd, struct PCB *pcb, char *elf_file, st
             return err;
         }
 
-        /* Load segment */
-        err = elf_load_segment_into_vspace(dest_pd,
-                dest_as,
-                source_addr,
-                segment_size,
-                file_size, vaddr,
-                get_sel4_rights_from_elf(flags) & seL4_AllRights,
-                pcb,
-                vnode);
+        /* Nothing is loaded now, pages are read from the file as they are faulted on */
+        struct vnode *region_vnode;
+        err = vfs_open(vnode->path, FM_READ, &region_vnode);
         if (err) {
             return err;
         }
+        as_set_region_file(dest_as, vaddr, region_vnode, offset, file_size);
     }
 
-    return 0;
+    return elf_load_shared_pages(pcb, elf_file, vnode);
 }
@@ -5,6 +5,8 @@
 #include <cspace/cspace.h>
 #include <utils/page.h>
 #include <fcntl.h>
+#include <clock/clock.h>
+#include <sos.h>
 
 #include "vmem_layout.h"
 #include "ut_manager/ut.h"
@@ -13,17 +15,20 @@
 #include "vnode.h"
 #include "frametable.h"
 #include "mapping.h"
+#include "pageout.h"
+#include "swap_bitmap.h"
+#include "share_vm.h"
+#include "coroutine.h"
+#include "working_set.h"
+#include "page_compress.h"
+#include "swap_cache.h"
+#include "zswap.h"
 
 #include <sys/panic.h>
 
 
-/* Emulate limited frames */
-#define LIMIT_FRAMES
-
-#ifdef LIMIT_FRAMES
-#define MAX_FRAMES 500
-int frames_to_alloc = 0;
-#endif
+/* Frame budget at boot, small enough to exercise swapping (0 for all of memory) */
+#define DEFAULT_FRAME_LIMIT 500
 
 
 #define PAGE_SIZE 4096lu /* In bytes */
@@ -34,10 +39,24 @@ int frames_to_alloc = 0;
 #define FRAME_VALID (1 << 0)
 #define FRAME_SWAPPABLE (1 << 1)
 #define FRAME_REFERENCE (1 << 2)
-#define FRAME_PID_MASK (~7)
-#define PID_SHIFT 3
+#define FRAME_DIRTY (1 << 3)
+#define FRAME_LARGE (1 << 4)
+#define FRAME_BUSY (1 << 5)
+#define FRAME_PINNED (1 << 6)
+#define FRAME_KERNEL (1 << 7)
+#define FRAME_PID_MASK (~255)
+#define PID_SHIFT 8
+
+/* Working set window in units of the owner's virtual time (page faults).
+ * Pages not referenced within this window are outside the working set */
+#define WS_TAU 64
+
+/* Victims tried when large frames keep getting written to while being cleaned,
+ * or frames freed by swapping keep getting taken before the swapper gets them */
+#define SWAP_OUT_TRIES 8
 
 extern struct PCB *curproc;
+extern int curr_coroutine_id;
 
 /* Name of swapfile */
 const char *swapfile = "pagefile";
@@ -45,17 +64,47 @@ const char *swapfile = "pagefile";
 /* Static struct declarations */
 
 /*
- * XXXXXX| R | S | V |
- * R:reference bit which used for second chance replacement
+ * Frame table, kept as parallel arrays indexed by frame so the victim
+ * scan only streams through the masks and touches the rest for candidates
+ *
+ * frame_mask:
+ * XXXXXX| K | P | B | L | D | R | S | V |
+ * K:kernel bit, frame was allocated unswappable for SOS's own use
+ * P:pinned bit, large frame was pinned while busy and must stay unswappable
+ * B:busy bit, large frame is being written to the pagefile
+ * L:large bit, first entry of a large frame. The other entries of the
+ *   large frame only have this bit set and keep the first in next_index
+ * D:dirty bit, frame has no up to date copy in the pagefile
+ * R:reference bit which is sampled by the WSClock hand
  * S:Swappable bit because some frame is allocated as coroutine stack
  * V:frame that is valid , which can be swaped if swap bit is on
+ *
+ * frame_state (packed into 8 bytes):
+ * last_use is the low 16 bits of the owner's virtual time when the frame was
+ * last seen referenced, ages are taken modulo 2^16 which is far beyond WS_TAU
+ * swap_index is the pagefile slot still holding a copy of a clean frame (-1 if none),
+ * for large frames each entry has the slot of its own piece
+ * share_id is the share owning the frame (-1 if private), sharers' page table
+ * entries hold the frame address while mapped so this leads back to the share
+ * next_index links free frames and the pieces of a large frame, neither of
+ * which can be shared so it overlaps share_id. Slots, frame indices and
+ * share ids all fit in 24 bits
+ *
+ * frame_caps is SOS's own cap to the frame, frame_rmap points at the chain
+ * of mappers of the frame (NULL while unmapped), the first one owns it
  */
-static struct frame_entry {
-    seL4_CPtr cap;
-    struct app_cap app_caps;
-    int32_t next_index;
-    uint32_t mask;
-};
+static struct frame_state {
+    uint16_t last_use;
+    int32_t swap_index : 24;
+    union {
+        int32_t next_index : 24;
+        int32_t share_id : 24;
+    } __attribute__((packed));
+} __attribute__((packed));
+
+/* Bytes of frame table per frame */
+#define FRAME_ENTRY_SIZE (sizeof(uint32_t) + sizeof(struct frame_state) + \
+        sizeof(seL4_CPtr) + sizeof(struct app_cap *))
 
 static struct frame_table_cap {
     seL4_CPtr cap;
@@ -63,7 +112,10 @@ static struct frame_table_cap {
 };
 
 /* Frame table */
-static struct frame_entry *frame_table;
+static uint32_t *frame_mask;
+static struct frame_state *frame_state;
+static seL4_CPtr *frame_caps;
+static struct app_cap **frame_rmap;
 static uint64_t base_addr; /* Start of untyped region after end of frame table */
 static int32_t low_addr; /* Low addr of memory */
 static int32_t high_addr; /* High addr of memory */
@@ -74,14 +126,73 @@ static struct frame_table_cap *frame_table_cap_head; /* Linked list of the actua
 struct vnode *swap_vnode;
 static uint32_t swap_victim_index = 0;
 
+/* Compressed pages are stored after their 2 byte length */
+#define SWAP_HEADER_SIZE 2
+
+/* Most pages written out in one burst (a large frame goes in several) */
+#define SWAP_CLUSTER_MAX 8
+
+/* A private page being written out, enough to finish with it after yielding */
+static struct swap_victim {
+    uint32_t index;
+    seL4_Word uaddr;
+    struct PCB *pcb;
+    pid_t pid;
+    unsigned int stime;
+};
+
+/* Pagefile traffic, reported by sos_vm_stats */
+static sos_vm_stats_t vm_stats;
+
 /* 0 >= Index of free frame from freelist
    -1 = EMPTY_FREELIST = Nothing in freelist (Will allocate new memory) */
 static int32_t free_index;
+static uint32_t free_count = 0; /* Frames on either freelist */
+
+/* Free frames already cleared while idle, kept on their own freelist */
+#define ZERO_POOL_TARGET 64
+#define ZERO_POOL_BATCH 8
+
+static int32_t zero_index = EMPTY_FREELIST;
+static uint32_t zero_count = 0;
+
+/* Set once no new frames can be retyped, from then on only the freelist is available */
+static int out_of_frames = 0;
+
+/* Frames user and SOS data may occupy at once, set at runtime (0 for no limit) */
+static uint32_t frame_limit = DEFAULT_FRAME_LIMIT;
+static uint32_t frames_allocated = 0; /* Frames retyped from untyped memory */
+static uint32_t unswappable_count = 0; /* Frames allocated unswappable for SOS's own use */
+
+/* Coroutines waiting for a large frame to finish being written out */
+static struct large_waiter {
+    pid_t pid;
+    unsigned int stime;
+    int coroutine_id;
+    struct large_waiter *next;
+};
+
+static struct large_waiter *large_waiters = NULL;
 
 static void reset_frame_mask(uint32_t index);
-static seL4_Word get_free_frame();
+static seL4_Word get_free_frame(int flags);
+static int32_t choose_victim(struct app_addrspace *owner);
+static int32_t frame_alloc_swap(seL4_Word *vaddr, int flags);
+static void soft_unmap_frame(uint32_t index);
+static void evict_clean_frame(uint32_t index);
+static void unmap_all_mappers(uint32_t index, int32_t swap_index);
+static int32_t swap_out_large(uint32_t index);
+static int32_t swap_out_shared(uint32_t victim);
+static int32_t swap_out_cluster(uint32_t victim);
+static int32_t swap_out_file(uint32_t victim);
+static int32_t write_swap_pages(seL4_Word *vaddrs, int count, int32_t *indices);
+static int32_t swap_in_readahead(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index);
+static void swap_in_done(seL4_Word sos_vaddr, uint32_t swap_index);
+static void large_frame_free(uint32_t index);
 
 static inline uint32_t frame_vaddr_to_index(seL4_Word sos_vaddr);
+static inline uint32_t frame_pieces(uint32_t index);
+static inline uint32_t frame_vaddr_to_head(seL4_Word sos_vaddr);
 static inline seL4_Word frame_index_to_vaddr(uint32_t index);
 
 static inline seL4_Word frame_paddr_to_vaddr(seL4_Word paddr);
@@ -92,7 +203,7 @@ void frame_init(seL4_Word high, seL4_Word low) {
     int32_t err;
     uint64_t low64 = low;
     uint64_t high64 = high;
-    uint64_t entry_size = sizeof(struct frame_entry);
+    uint64_t entry_size = FRAME_ENTRY_SIZE;
 
     /* Set/calculate untyped region bounds */
 
@@ -106,7 +217,8 @@ void frame_init(seL4_Word high, seL4_Word low) {
      * (base_address - low) / sizeof(entry) >= (high - base_address) / PAGE_SIZE
      */
     base_addr = (high64 * entry_size + PAGE_SIZE * low64) / (entry_size + PAGE_SIZE);
-    low_addr = low;
+    /* Note: The window starts large page aligned so large frames are aligned in SOS too */
+    low_addr = PAGE_ALIGN_LARGE(low);
     high_addr = high;
 
     /* Calculate frame table size */
@@ -118,6 +230,7 @@ void frame_init(seL4_Word high, seL4_Word low) {
     num_frames = num_entries;
     if (num_entries < num_pages) {
         frame_table_size += entry_size;
+        num_frames = num_pages;
     }
     base_addr = low;
 
@@ -146,20 +259,24 @@ void frame_init(seL4_Word high, seL4_Word low) {
                 seL4_ARM_Default_VMAttributes);
         conditional_panic(err, "Failed to map initial frame table");
 
-        /* Set pointer to head of frame_table and keep track of caps */
+        /* Set pointers to the frame table arrays and keep track of caps */
         struct frame_table_cap *cap_holder = malloc(sizeof(struct frame_table_cap));
         conditional_panic(cap_holder == NULL, "Failed to allocate initial frame cap holder\n");
         cap_holder->cap = cap;
 
         if (i == 0) {
-            frame_table = ft_section_vaddr;
+            /* Note: The arrays are laid out back to back, each one is word aligned */
+            frame_mask = ft_section_vaddr;
+            frame_state = (struct frame_state *) (frame_mask + num_frames);
+            frame_caps = (seL4_CPtr *) (frame_state + num_frames);
+            frame_rmap = (struct app_cap **) (frame_caps + num_frames);
             cap_holder->next = NULL;
         } else {
             cap_holder->next = frame_table_cap_head;
         }
         frame_table_cap_head = cap_holder;
 
-        /* Clear frame_table memory */
+        /* Clear frame table memory */
         memset(ft_section_vaddr, 0, PAGE_SIZE);
         base_addr += PAGE_SIZE;
     }
@@ -168,6 +285,10 @@ void frame_init(seL4_Word high, seL4_Word low) {
     free_index = EMPTY_FREELIST;
 }
 
+int32_t frame_alloc(seL4_Word *vaddr) {
+    return frame_alloc_flags(vaddr, 0);
+}
+
 /* Allocate a frame which is unswappable */
 int32_t unswappable_alloc(seL4_Word *vaddr) {
     int err = frame_alloc(vaddr);
@@ -175,84 +296,428 @@ int32_t unswappable_alloc(seL4_Word *vaddr) {
     
     /* Set unswappable */
     uint32_t index = frame_vaddr_to_index(*vaddr);
-    frame_table[index].mask &= (~FRAME_SWAPPABLE);
+    frame_mask[index] &= (~FRAME_SWAPPABLE);
+    frame_mask[index] |= FRAME_KERNEL;
+    unswappable_count++;
+
+    return 0;
+}
+
+/*
+ * Allocate a large frame
+ * Note: This never swaps, callers fall back to small frames under memory pressure
+ */
+int32_t large_frame_alloc(seL4_Word *vaddr) {
+    int err;
+
+    *vaddr = NULL;
+
+    /* Note: This also keeps large frames within the frame budget */
+    if (out_of_frames || frame_available() < LARGE_PAGE_FRAMES + PAGEOUT_HIGH_WATERMARK) {
+        return -1;
+    }
+
+    /* Get untyped memory */
+    seL4_Word frame_paddr = ut_alloc(LARGE_PAGE_BITS);
+    if (frame_paddr == NULL) return -1;
+
+    /* Retype to large frame */
+    seL4_Word frame_cap;
+    err = cspace_ut_retype_addr(frame_paddr,
+            seL4_ARM_LargePageObject,
+            LARGE_PAGE_BITS,
+            cur_cspace,
+            &frame_cap);
+    if (err) {
+        ut_free(frame_paddr, LARGE_PAGE_BITS);
+        return -1;
+    }
+
+    /* Map to address space */
+    seL4_Word frame_vaddr = frame_paddr_to_vaddr(frame_paddr);
+    err = map_page(frame_cap,
+            seL4_CapInitThreadPD,
+            frame_vaddr,
+            seL4_AllRights,
+            seL4_ARM_Default_VMAttributes);
+    if (err) {
+        cspace_delete_cap(cur_cspace, frame_cap);
+        ut_free(frame_paddr, LARGE_PAGE_BITS);
+        return -1;
+    }
+
+    /* First entry tracks the frame, the rest point back to it */
+    uint32_t index = frame_paddr_to_index(frame_paddr);
+    reset_frame_mask(index);
+    frame_mask[index] |= FRAME_LARGE;
+    frame_caps[index] = frame_cap;
+
+    for (int i = 1; i < LARGE_PAGE_FRAMES; i++) {
+        frame_mask[index + i] = FRAME_LARGE;
+        frame_state[index + i].next_index = index;
+        frame_state[index + i].swap_index = -1;
+    }
+
+    frames_allocated += LARGE_PAGE_FRAMES;
+
+    /* Clear frame */
+    memset(frame_vaddr, 0, LARGE_PAGE_SIZE);
+
+    *vaddr = frame_vaddr;
 
     return 0;
 }
 
+/* Give a large frame's memory back to the untyped allocator */
+static void large_frame_free(uint32_t index) {
+    seL4_CPtr cap = frame_caps[index];
+
+    for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+        if (frame_state[index + i].swap_index >= 0) {
+            free_swap_index(frame_state[index + i].swap_index);
+        }
+        frame_state[index + i].swap_index = -1;
+        frame_mask[index + i] = 0;
+    }
+    frame_caps[index] = seL4_CapNull;
+    frame_rmap[index] = NULL;
+
+    seL4_ARM_Page_Unmap(cap);
+    cspace_delete_cap(cur_cspace, cap);
+    ut_free(base_addr + (index << INDEX_ADDR_OFFSET), LARGE_PAGE_BITS);
+
+    frames_allocated -= LARGE_PAGE_FRAMES;
+
+    /* Note: Small frames can be retyped from it again */
+    out_of_frames = 0;
+}
+
+/* Unmap a frame from its owner so the next access takes a soft fault,
+ * which is how the reference bit gets set for user accesses */
+static void soft_unmap_frame(uint32_t index) {
+    struct app_cap *app_cap = frame_rmap[index];
+
+    /* Note: Shared frames are unmapped from every sharer */
+    while (app_cap != NULL) {
+        struct app_addrspace *as = app_cap->pcb->addrspace;
+        int index1 = root_index(app_cap->uaddr);
+        int index2 = leaf_index(app_cap->uaddr);
+
+        if ((as->page_table[index1][index2].sos_vaddr & PTE_SOFT) == 0 &&
+                seL4_ARM_Page_Unmap(app_cap->cap) == 0) {
+            sos_pte_update(as, app_cap->uaddr, PTE_SOFT, 0);
+        }
+
+        app_cap = app_cap->next;
+    }
+}
+
+/*
+ * WSClock victim selection
+ *
+ * Referenced frames get their bit cleared, their age reset and are
+ * unmapped so the owner soft faults on the next access. Unreferenced
+ * frames older than WS_TAU (in the owner's virtual time) are outside
+ * the working set, clean ones are taken straight away. If a whole
+ * revolution finds no clean old frame, fall back to an old dirty frame
+ * and then to any unreferenced frame.
+ * Unreferenced frames of processes over their resident set limit or
+ * working set target are taken first. Given an owner, only its frames are considered.
+ */
+static int32_t choose_victim(struct app_addrspace *owner) {
+    int32_t old_dirty = -1;
+    int32_t unreferenced = -1;
+
+    for (uint32_t n = 0; n < 2 * num_frames; n++) {
+        if (n >= num_frames && (old_dirty != -1 || unreferenced != -1)) break;
+
+        uint32_t i = swap_victim_index;
+        swap_victim_index = (swap_victim_index + 1) % num_frames;
+
+        uint32_t mask = frame_mask[i];
+        if ((mask & FRAME_VALID) == 0 || (mask & FRAME_SWAPPABLE) == 0) continue;
+        if (frame_rmap[i] == NULL) continue;
+
+        struct app_addrspace *as = frame_rmap[i]->pcb->addrspace;
+        if (owner != NULL && as != owner) continue;
+
+        if (mask & FRAME_REFERENCE) {
+            /* Second chance, sample the frame again on the next revolution */
+            frame_mask[i] &= (~FRAME_REFERENCE);
+            frame_state[i].last_use = as->fault_count;
+            soft_unmap_frame(i);
+            continue;
+        }
+
+        seL4_Word limit = ws_limit(as);
+        if (limit != 0 && as->rss > limit) return i;
+
+        uint16_t age = as->fault_count - frame_state[i].last_use;
+        if (age >= WS_TAU) {
+            if ((mask & FRAME_DIRTY) == 0) return i;
+            if (old_dirty == -1) old_dirty = i;
+        } else if (unreferenced == -1) {
+            unreferenced = i;
+        }
+    }
+
+    if (old_dirty != -1) return old_dirty;
+    return unreferenced;
+}
+
+/* Mark a frame as written to, its pagefile copy is now stale */
+void dirty_frame_entry(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_head(sos_vaddr);
+    if ((frame_mask[index] & FRAME_VALID) == 0) return;
+
+    frame_mask[index] |= FRAME_DIRTY;
+
+    /* Note: Slots still being written are released by the writer */
+    if (frame_mask[index] & FRAME_BUSY) return;
+
+    int pieces = (frame_mask[index] & FRAME_LARGE) ? LARGE_PAGE_FRAMES : 1;
+    for (int i = 0; i < pieces; i++) {
+        if (frame_state[index + i].swap_index >= 0) {
+            free_swap_index(frame_state[index + i].swap_index);
+            frame_state[index + i].swap_index = -1;
+        }
+    }
+}
+
+/* Mark a frame as matching its backing file, the next write dirties it again */
+void clean_frame_entry(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_head(sos_vaddr);
+    if ((frame_mask[index] & FRAME_VALID) == 0) return;
+
+    frame_mask[index] &= (~FRAME_DIRTY);
+}
+
+int is_frame_dirty(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_head(sos_vaddr);
+    return (frame_mask[index] & FRAME_DIRTY) != 0;
+}
+
+/* Mark a frame as referenced by its owner (called on soft faults) */
+void reference_frame_entry(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_head(sos_vaddr);
+    if ((frame_mask[index] & FRAME_VALID) == 0) return;
+
+    frame_mask[index] |= FRAME_REFERENCE;
+    if (frame_rmap[index] != NULL) {
+        frame_state[index].last_use = frame_rmap[index]->pcb->addrspace->fault_count;
+    }
+}
+
+/* Evict a clean frame by handing its pagefile slot back to the page table
+ * Note: This does no I/O so the owner can not change underneath us */
+static void evict_clean_frame(uint32_t index) {
+    seL4_Word frame_vaddr = frame_index_to_vaddr(index);
+    seL4_Word uaddr = frame_rmap[index]->uaddr;
+    struct app_addrspace *as = frame_rmap[index]->pcb->addrspace;
+    int32_t swap_index = frame_state[index].swap_index;
+
+    struct shared_page *sp = NULL;
+    if (as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr & PTE_SHARED) {
+        sp = share_swap_begin(uaddr, as);
+    }
+
+    unmap_all_mappers(index, swap_index);
+
+    /* Slot now belongs to the page table entries (or the share) */
+    frame_state[index].swap_index = -1;
+    if (sp != NULL) share_swap_end(sp, swap_index);
+
+    frame_free(frame_vaddr);
+}
+
+/* Unmap a frame from all of its mappers, marking their pages as swapped to swap_index */
+static void unmap_all_mappers(uint32_t index, int32_t swap_index) {
+    seL4_Word frame_vaddr = frame_index_to_vaddr(index);
+
+    while (frame_rmap[index] != NULL) {
+        struct app_cap *app_cap = frame_rmap[index];
+        struct app_addrspace *as = app_cap->pcb->addrspace;
+        int index1 = root_index(app_cap->uaddr);
+        int index2 = leaf_index(app_cap->uaddr);
+
+        /* Sharers point at the share instead, which holds the slot */
+        seL4_Word pte = as->page_table[index1][index2].sos_vaddr;
+        if (pte & PTE_SHARED) {
+            pte = pte_set_index(pte, frame_state[index].share_id);
+        } else {
+            pte = pte_set_index(pte, swap_index);
+        }
+        as->page_table[index1][index2].sos_vaddr = (pte & (~PTE_SOFT)) | PTE_SWAP;
+
+        sos_unmap_page(frame_vaddr, as);
+    }
+}
+
 /* Swap out a frame to backing store so it can be reused */
 int32_t swap_out() {
-    /* Find a victim to swap out */
-    int victim = swap_victim_index;
-    for (int i = victim; ; i = (i + 1) % num_frames) {
-        if ((frame_table[i].mask & FRAME_VALID) &&
-            (frame_table[i].mask & FRAME_SWAPPABLE)) {
-
-            if (frame_table[i].mask & FRAME_REFERENCE) {
-                /* Clear reference */
-                frame_table[i].mask &= (~FRAME_REFERENCE);
-            } else {
-                /* Found victim */
-                victim = i;
-                swap_victim_index = (victim + 1) % num_frames;
-                break;
-            }
+    return swap_out_owner(NULL);
+}
+
+/* Swap out one of owner's frames (anyone's if NULL) */
+int32_t swap_out_owner(struct app_addrspace *owner) {
+    int victim = -1;
 
+    for (int tries = 0; victim < 0; tries++) {
+        if (tries == SWAP_OUT_TRIES) return -1;
+
+        /* Find a victim to swap out */
+        victim = choose_victim(owner);
+        if (victim < 0) return -1;
+
+        if (frame_mask[victim] & FRAME_LARGE) {
+            /* Note: A large frame written to while being cleaned is kept, so pick again */
+            int err = swap_out_large(victim);
+            if (err > 0) {
+                victim = -1;
+                continue;
+            }
+            return err;
         }
     }
 
+    if ((frame_mask[victim] & FRAME_DIRTY) == 0 && frame_state[victim].swap_index >= 0) {
+        /* Clean frame still has its copy in the pagefile, just drop it */
+        evict_clean_frame(victim);
+        return 0;
+    }
+
+    struct app_cap *app_cap = frame_rmap[victim];
+    struct app_addrspace *as = app_cap->pcb->addrspace;
+    seL4_Word pte = as->page_table[root_index(app_cap->uaddr)][leaf_index(app_cap->uaddr)].sos_vaddr;
+    if (pte & PTE_SHARED) return swap_out_shared(victim);
+
+    struct region *region = as_get_region(as, app_cap->uaddr);
+    if (region != NULL && (region->flags & REGION_WRITEBACK)) return swap_out_file(victim);
+
+    return swap_out_cluster(victim);
+}
+
+/* Write a shared frame out and hand its slot to the share */
+static int32_t swap_out_shared(uint32_t victim) {
     seL4_Word frame_vaddr = frame_index_to_vaddr(victim);
+    seL4_Word uaddr = frame_rmap[victim]->uaddr;
+    struct app_addrspace *as = frame_rmap[victim]->pcb->addrspace;
 
     /* Temporarily mark frame as unswappable because it is being swapped out */
-    frame_table[victim].mask &= (~FRAME_SWAPPABLE);
+    frame_mask[victim] &= (~FRAME_SWAPPABLE);
 
-    if (swap_vnode == NULL) {
-        /* First time opening swapfile */
-        int err = vfs_open(swapfile, FM_READ | FM_WRITE, &swap_vnode);
-        if (err) return -1;
-    }
+    /* Sharers that fault during the write wait on the share instead */
+    struct shared_page *sp = share_swap_begin(uaddr, as);
+    unmap_all_mappers(victim, -1);
+
+    int32_t swap_index = -1;
+    int err = write_swap_pages(&frame_vaddr, 1, &swap_index);
+
+    /* Remark frame as swappable */
+    frame_mask[victim] |= FRAME_SWAPPABLE;
 
-    /* Get swap offset */
-    int swap_offset = get_swap_index();
-    if (swap_offset < 0) {
+    if (err) {
+        /* Frame stays with the share, unless every sharer left meanwhile */
+        if (share_swap_abort(sp, frame_vaddr)) frame_free(frame_vaddr);
         return -1;
     }
 
-	seL4_Word uaddr = frame_table[victim].app_caps.uaddr;
+    share_swap_end(sp, swap_index);
+    frame_free(frame_vaddr);
+    seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
+    return 0;
+}
 
-    /* Update details of old addrspace */
-    int index1 = root_index(uaddr);
-    int index2 = leaf_index(uaddr);
+/* Frame of a neighbouring private page that may join a cluster, -1 if it can not */
+static int32_t cluster_candidate(struct app_addrspace *as, seL4_Word uaddr) {
+    if (as->page_table[root_index(uaddr)] == NULL) return -1;
 
-    struct PCB *pcb = frame_table[victim].app_caps.pcb;
-    int pid = pcb->pid;
-    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word pte = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+    if ((pte & PTE_VALID) == 0) return -1;
+    if (pte & (PTE_SWAP | PTE_BEINGSWAPPED | PTE_SHARED | PTE_LARGE | PTE_ZERO | PTE_IMAGE)) return -1;
+
+    uint32_t index = frame_vaddr_to_index(PAGE_ALIGN_4K(pte));
+    uint32_t mask = frame_mask[index];
+    if ((mask & FRAME_VALID) == 0 || (mask & FRAME_SWAPPABLE) == 0) return -1;
 
-    /* Mark it as swapped out */
+    /* Recently used pages stay */
+    if (mask & FRAME_REFERENCE) return -1;
+
+    /* Clean frames are evicted without writing, leave them to the clock */
+    if ((mask & FRAME_DIRTY) == 0 && frame_state[index].swap_index >= 0) return -1;
+
+    if (frame_rmap[index] == NULL) return -1;
+    if (frame_rmap[index]->pcb->addrspace != as) return -1;
+
+    /* Pages of written back regions go to their file instead */
+    struct region *region = as_get_region(as, uaddr);
+    if (region == NULL || (region->flags & REGION_WRITEBACK)) return -1;
+
+    return index;
+}
+
+/* Resume the owner of a frame being written out that faulted on it meanwhile */
+static void swap_wake_owner(uint32_t index) {
+    int pid = frame_mask[index] >> PID_SHIFT;
+    struct PCB *pcb = process_status(pid);
+    set_resume(pcb->coroutine_id);
+}
+
+/* Take a private page from its owner for the write
+ * Note: The entry keeps the frame address until the write is done */
+static void swap_begin_private(struct swap_victim *victim) {
+    struct app_addrspace *as = victim->pcb->addrspace;
+    int index1 = root_index(victim->uaddr);
+    int index2 = leaf_index(victim->uaddr);
+
+    /* Temporarily mark frame as unswappable because it is being swapped out */
+    frame_mask[victim->index] &= (~FRAME_SWAPPABLE);
+
+    as->page_table[index1][index2].sos_vaddr &= (~PTE_SOFT);
     as->page_table[index1][index2].sos_vaddr |= PTE_SWAP;
     as->page_table[index1][index2].sos_vaddr |= PTE_BEINGSWAPPED;
-    as->swap_table[index1][index2].swap_index = swap_offset;
-    
-    sos_unmap_page(frame_vaddr, as);
 
-    struct uio uio = {
-        .vaddr = PAGE_ALIGN_4K(frame_vaddr),
-        .uaddr = NULL,
-        .size = PAGE_SIZE_4K,
-        .offset = swap_offset * PAGE_SIZE_4K,
-        .remaining = PAGE_SIZE_4K
-    };
+    sos_unmap_page(frame_index_to_vaddr(victim->index), as);
+}
 
-    unsigned int stime = pcb->stime;
+/* Hand the slot of a written private page to its page table entry, or map it back on error */
+static void swap_end_private(struct swap_victim *victim, int32_t swap_index, int err) {
+    seL4_Word frame_vaddr = frame_index_to_vaddr(victim->index);
+
+    /* Remark frame as swappable */
+    frame_mask[victim->index] |= FRAME_SWAPPABLE;
+
+    if (!is_still_valid_proc(victim->pid, victim->stime)) {
+        /* Process was destroyed, the slot was never handed to its page table */
+        if (swap_index >= 0) free_swap_index(swap_index);
+        frame_free(frame_vaddr);
+        seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
+        return;
+    }
+
+    struct app_addrspace *as = victim->pcb->addrspace;
+    int index1 = root_index(victim->uaddr);
+    int index2 = leaf_index(victim->uaddr);
+
+    seL4_Word pte = as->page_table[index1][index2].sos_vaddr;
+
+    if (err && (PAGE_ALIGN_4K(pte) != frame_vaddr || (pte & PTE_SWAP) == 0)) {
+        /* The entry no longer refers to the frame, nobody to give it back to */
+        frame_free(frame_vaddr);
+        return;
+    }
+
+    if (err && (pte & PTE_BEINGSWAPPED) == 0) {
+        /* Owner faulted on it meanwhile, it drops the frame it mapped and takes this one back */
+        as->page_table[index1][index2].sos_vaddr = (pte & (~PTE_SWAP)) | PTE_SOFT;
+        swap_wake_owner(victim->index);
+        return;
+    }
 
-    /* Swap frame out */
-    int err = swap_vnode->ops->vop_write(swap_vnode, &uio);
     if (err) {
         as->page_table[index1][index2].sos_vaddr &= (~PTE_SWAP);
         as->page_table[index1][index2].sos_vaddr &= (~PTE_BEINGSWAPPED);
 
-        seL4_ARM_PageDirectory pd = pcb->vroot;
-        struct app_addrspace *as = pcb->addrspace;
         seL4_CPtr cap = get_cap(frame_vaddr);
         seL4_CPtr copied_cap;
         copied_cap = cspace_copy_cap(cur_cspace,
@@ -260,124 +725,660 @@ int32_t swap_out() {
                 cap,
                 seL4_AllRights);
 
-        struct region *curr_region = as->regions;
-        while (curr_region != NULL) {
-            if (uaddr >= curr_region->baseaddr &&
-                    uaddr < curr_region->baseaddr + curr_region->size) {
-                break;
-            }
-            curr_region = curr_region->next;
+        /* Clean frames stay read-only so the next write is caught */
+        struct region *curr_region = as_get_region(as, victim->uaddr);
+        seL4_CapRights rights = curr_region->permissions;
+        if ((frame_mask[victim->index] & FRAME_DIRTY) == 0) {
+            rights &= (~seL4_CanWrite);
         }
-        err = map_page(copied_cap,
-                pd,
-                uaddr,
-                curr_region->permissions,
+
+        map_page(copied_cap,
+                victim->pcb->vroot,
+                victim->uaddr,
+                rights,
                 seL4_ARM_Default_VMAttributes);
 
         /* Book keeping the copied caps */
-        insert_app_cap(PAGE_ALIGN_4K(frame_vaddr),
+        err = insert_app_cap(PAGE_ALIGN_4K(frame_vaddr),
                 copied_cap,
-                pcb,
-                uaddr);
+                victim->pcb,
+                victim->uaddr);
+        if (err) {
+            /* Left soft, the next fault maps it again */
+            seL4_ARM_Page_Unmap(copied_cap);
+            cspace_delete_cap(cur_cspace, copied_cap);
+            as->page_table[index1][index2].sos_vaddr |= PTE_SOFT;
+        }
+        return;
+    }
 
+    /* The entry now refers to the slot, pages written back to their file are untouched again */
+    if (swap_index < 0) {
+        as->page_table[index1][index2].sos_vaddr = 0;
+        as->page_count--;
+    } else {
+        as->page_table[index1][index2].sos_vaddr = pte_set_index(pte & (~PTE_BEINGSWAPPED), swap_index);
+    }
+
+    if ((pte & PTE_BEINGSWAPPED) == 0) {
+        /* Owner faulted on it meanwhile and is waiting to read it back in */
+        swap_wake_owner(victim->index);
+    }
+
+    frame_free(frame_vaddr);
+
+    seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
+}
+
+/*
+ * Write a private victim out together with the run of its owner's pages
+ * around it that are also due to go, so they share one burst of writes
+ * to contiguous slots
+ */
+static int32_t swap_out_cluster(uint32_t victim) {
+    struct swap_victim cluster[SWAP_CLUSTER_MAX];
+    seL4_Word vaddrs[SWAP_CLUSTER_MAX];
+    int32_t indices[SWAP_CLUSTER_MAX];
+
+    struct PCB *pcb = frame_rmap[victim]->pcb;
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word uaddr = frame_rmap[victim]->uaddr;
+
+    /* Grow the run forwards first, then backwards */
+    seL4_Word first = uaddr;
+    seL4_Word last = uaddr;
+    int count = 1;
+    while (count < SWAP_CLUSTER_MAX && cluster_candidate(as, last + PAGE_SIZE_4K) >= 0) {
+        last += PAGE_SIZE_4K;
+        count++;
+    }
+    while (count < SWAP_CLUSTER_MAX && first >= PAGE_SIZE_4K &&
+            cluster_candidate(as, first - PAGE_SIZE_4K) >= 0) {
+        first -= PAGE_SIZE_4K;
+        count++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        seL4_Word page = first + i * PAGE_SIZE_4K;
+
+        cluster[i].index = (page == uaddr) ? victim : cluster_candidate(as, page);
+        cluster[i].uaddr = page;
+        cluster[i].pcb = pcb;
+        cluster[i].pid = pcb->pid;
+        cluster[i].stime = pcb->stime;
+
+        vaddrs[i] = frame_index_to_vaddr(cluster[i].index);
+        indices[i] = -1;
+
+        swap_begin_private(&cluster[i]);
+    }
+
+    int err = write_swap_pages(vaddrs, count, indices);
+
+    for (int i = 0; i < count; i++) {
+        swap_end_private(&cluster[i], indices[i], err);
+    }
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Evict a page of a written back region by writing it to its file if it
+ * was written to since it was read, the next fault reads it from there
+ */
+static int32_t swap_out_file(uint32_t victim) {
+    struct PCB *pcb = frame_rmap[victim]->pcb;
+    struct swap_victim page = {
+        .index = victim,
+        .uaddr = frame_rmap[victim]->uaddr,
+        .pcb = pcb,
+        .pid = pcb->pid,
+        .stime = pcb->stime
+    };
+    struct region *region = as_get_region(pcb->addrspace, page.uaddr);
+
+    swap_begin_private(&page);
+
+    int err = 0;
+    if (frame_mask[victim] & FRAME_DIRTY) {
+        err = sos_write_page(page.uaddr, frame_index_to_vaddr(victim), region, pcb);
+    }
+
+    swap_end_private(&page, -1, err);
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Write pcb's resident page at uaddr of a written back region to its file
+ * if it was written to since it was read
+ * Note: The frame is cleaned and unmapped before the write so writes made
+ *       while it is in flight dirty it again
+ */
+int32_t frame_sync_page(seL4_Word uaddr, struct PCB *pcb, struct region *region) {
+    struct app_addrspace *as = pcb->addrspace;
+    if (as->page_table == NULL || as->page_table[root_index(uaddr)] == NULL) return 0;
+
+    /* Note: Shared pages go to the pagefile like elsewhere */
+    seL4_Word pte = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+    if ((pte & PTE_VALID) == 0) return 0;
+    if (pte & (PTE_SWAP | PTE_BEINGSWAPPED | PTE_SHARED | PTE_LARGE | PTE_ZERO | PTE_IMAGE)) return 0;
+
+    uint32_t index = frame_vaddr_to_index(PAGE_ALIGN_4K(pte));
+    if ((frame_mask[index] & FRAME_DIRTY) == 0) return 0;
+
+    frame_mask[index] &= (~FRAME_DIRTY);
+    soft_unmap_frame(index);
+
+    /* Temporarily mark frame as unswappable because it is being written */
+    uint32_t swappable = frame_mask[index] & FRAME_SWAPPABLE;
+    frame_mask[index] &= (~FRAME_SWAPPABLE);
+
+    int err = sos_write_page(uaddr, frame_index_to_vaddr(index), region, pcb);
+
+    frame_mask[index] |= swappable;
+    if (err) {
+        frame_mask[index] |= FRAME_DIRTY;
         return -1;
     }
 
-    /* Remark frame as swappable */
-    frame_table[victim].mask |= FRAME_SWAPPABLE;
+    return 0;
+}
 
-    if (!is_still_valid_proc(pid, stime)) {
-        /* Process was destroyed */
-        frame_free(frame_vaddr);
-        seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
+/* Pack a page for the pagefile into out, returns the sectors it takes */
+uint32_t swap_pack_page(uint8_t *page, uint8_t *out) {
+    uint32_t sectors = SWAP_PAGE_SECTORS;
+
+    int len = page_compress(page, out + SWAP_HEADER_SIZE, PAGE_SIZE_4K - SWAP_HEADER_SIZE);
+    if (len >= 0) {
+        sectors = (len + SWAP_HEADER_SIZE + SWAP_SECTOR_SIZE - 1) / SWAP_SECTOR_SIZE;
+    }
+
+    if (sectors >= SWAP_PAGE_SECTORS) {
+        /* Does not compress, stored as is */
+        memcpy(out, page, PAGE_SIZE_4K);
+        return SWAP_PAGE_SECTORS;
+    }
+
+    out[0] = len & 0xff;
+    out[1] = len >> 8;
+    memset(out + SWAP_HEADER_SIZE + len, 0, sectors * SWAP_SECTOR_SIZE - SWAP_HEADER_SIZE - len);
+
+    return sectors;
+}
+
+/*
+ * Write pages (or pieces of a large frame) out back to back, each compressed
+ * if that saves a sector. They get contiguous slots in indices and go out as
+ * one pipelined burst of NFS writes.
+ * On error no slots are left allocated.
+ */
+static int32_t write_swap_pages(seL4_Word *vaddrs, int count, int32_t *indices) {
+    if (swap_vnode == NULL) {
+        /* First time opening swapfile */
+        int err = vfs_open(swapfile, FM_READ | FM_WRITE, &swap_vnode);
+        if (err) return -1;
+    }
+
+    uint8_t *buf = malloc(count * PAGE_SIZE_4K);
+    if (buf == NULL && count > 1) {
+        /* No room for the burst, write the pages one at a time */
+        for (int i = 0; i < count; i++) {
+            if (write_swap_pages(&vaddrs[i], 1, &indices[i])) {
+                while (i-- > 0) {
+                    free_swap_index(indices[i]);
+                    indices[i] = -1;
+                }
+                return -1;
+            }
+        }
         return 0;
     }
 
-    if (as->page_table[index1][index2].sos_vaddr & PTE_BEINGSWAPPED) {
-        as->page_table[index1][index2].sos_vaddr &= (~PTE_BEINGSWAPPED);
+    /* Note: Nothing can write the pages while packing since we do not yield */
+    uint32_t sectors[SWAP_CLUSTER_MAX];
+    uint32_t total = 0;
+    char *data = (char *) buf;
+    if (buf == NULL) {
+        /* Single page written raw straight from the frame */
+        sectors[0] = SWAP_PAGE_SECTORS;
+        total = SWAP_PAGE_SECTORS;
+        data = (char *) PAGE_ALIGN_4K(vaddrs[0]);
     } else {
-        int pid = frame_table[victim].mask >> PID_SHIFT;
-        struct PCB *pcb = process_status(pid);
-        set_resume(pcb->coroutine_id);
+        for (int i = 0; i < count; i++) {
+            sectors[i] = swap_pack_page((uint8_t *) PAGE_ALIGN_4K(vaddrs[i]),
+                    buf + total * SWAP_SECTOR_SIZE);
+            total += sectors[i];
+        }
+    }
+
+    if (get_swap_run(sectors, count, indices)) {
+        free(buf);
+        return -1;
+    }
+
+    /* Pages that compress well are kept in memory, the pagefile is only written if any do not */
+    int stored[SWAP_CLUSTER_MAX];
+    int pending = 0;
+    uint32_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        stored[i] = (buf != NULL && zswap_store(indices[i], buf + offset * SWAP_SECTOR_SIZE, sectors[i]) == 0);
+        if (!stored[i]) pending++;
+        offset += sectors[i];
+    }
+
+    if (pending == 0) {
+        free(buf);
+        return 0;
+    }
+
+    struct uio uio = {
+        .vaddr = data,
+        .uaddr = NULL,
+        .size = total * SWAP_SECTOR_SIZE,
+        .offset = indices[0] * SWAP_SECTOR_SIZE,
+        .remaining = total * SWAP_SECTOR_SIZE
+    };
+
+    timestamp_t start = time_stamp();
+    int err = swap_vnode->ops->vop_write(swap_vnode, &uio);
+    free(buf);
+
+    if (err) {
+        for (int i = 0; i < count; i++) {
+            free_swap_index(indices[i]);
+            indices[i] = -1;
+        }
+        return -1;
+    }
+
+    /* The pool's copies are now clean and can be dropped for free */
+    for (int i = 0; i < count; i++) {
+        if (stored[i]) zswap_mark_clean(indices[i]);
+    }
+
+    vm_stats.pages_out += count;
+    vm_stats.writes_out++;
+    for (int i = 0; i < count; i++) {
+        if (sectors[i] < SWAP_PAGE_SECTORS) vm_stats.pages_compressed++;
+    }
+    vm_stats.bytes_out += total * SWAP_SECTOR_SIZE;
+    vm_stats.swap_out_us += time_stamp() - start;
+
+    return 0;
+}
+
+static void large_wakeup() {
+    struct large_waiter *curr = large_waiters;
+    while (curr != NULL) {
+        struct large_waiter *to_free = curr;
+        if (is_still_valid_proc(curr->pid, curr->stime)) {
+            set_resume(curr->coroutine_id);
+        }
+        curr = curr->next;
+        free(to_free);
+    }
+    large_waiters = NULL;
+}
+
+/*
+ * Evict a large frame by splitting it into small pages in the pagefile
+ *
+ * The pieces are written out while the owner keeps running on a read-only
+ * mapping. If it writes meanwhile the copy is stale and the frame is kept.
+ * Otherwise the frame is dropped without further I/O and each piece comes
+ * back as a small page on its next fault.
+ * Returns 1 if the frame was written to meanwhile.
+ */
+static int32_t swap_out_large(uint32_t index) {
+    seL4_Word frame_vaddr = frame_index_to_vaddr(index);
+    int err = 0;
+
+    frame_mask[index] &= (~FRAME_SWAPPABLE);
+    frame_mask[index] |= FRAME_BUSY;
+
+    if (frame_mask[index] & FRAME_DIRTY) {
+        /* Catch writes made while the pieces are written out */
+        frame_mask[index] &= (~FRAME_DIRTY);
+        soft_unmap_frame(index);
+
+        for (int i = 0; i < LARGE_PAGE_FRAMES && !err; i += SWAP_CLUSTER_MAX) {
+            seL4_Word vaddrs[SWAP_CLUSTER_MAX];
+            int32_t indices[SWAP_CLUSTER_MAX];
+
+            for (int j = 0; j < SWAP_CLUSTER_MAX; j++) {
+                vaddrs[j] = frame_vaddr + (i + j) * PAGE_SIZE;
+                if (frame_state[index + i + j].swap_index >= 0) {
+                    free_swap_index(frame_state[index + i + j].swap_index);
+                    frame_state[index + i + j].swap_index = -1;
+                }
+            }
+
+            err = write_swap_pages(vaddrs, SWAP_CLUSTER_MAX, indices);
+            for (int j = 0; j < SWAP_CLUSTER_MAX && !err; j++) {
+                frame_state[index + i + j].swap_index = indices[j];
+            }
+        }
+    }
+
+    frame_mask[index] &= (~FRAME_BUSY);
+    large_wakeup();
+
+    if (frame_rmap[index] == NULL) {
+        /* Owner exited meanwhile */
+        large_frame_free(index);
+        return 0;
+    }
+
+    if (err || (frame_mask[index] & FRAME_DIRTY)) {
+        /* Pagefile copy is incomplete or stale */
+        frame_mask[index] |= FRAME_DIRTY;
+        if ((frame_mask[index] & FRAME_PINNED) == 0) {
+            frame_mask[index] |= FRAME_SWAPPABLE;
+        }
+
+        for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+            if (frame_state[index + i].swap_index >= 0) {
+                free_swap_index(frame_state[index + i].swap_index);
+                frame_state[index + i].swap_index = -1;
+            }
+        }
+
+        return err ? -1 : 1;
     }
 
-    frame_free(frame_vaddr); 
-	
-	seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
-	
-	return 0;
+    /* Every piece has a clean copy, hand the slots to the page table */
+    struct app_addrspace *as = frame_rmap[index]->pcb->addrspace;
+    seL4_Word uaddr = frame_rmap[index]->uaddr;
+
+    sos_unmap_page(frame_vaddr, as);
+
+    for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+        int index1 = root_index(uaddr + i * PAGE_SIZE);
+        int index2 = leaf_index(uaddr + i * PAGE_SIZE);
+
+        seL4_Word pte = as->page_table[index1][index2].sos_vaddr & (~(PTE_LARGE | PTE_SOFT));
+        as->page_table[index1][index2].sos_vaddr = pte_set_index(pte, frame_state[index + i].swap_index) | PTE_SWAP;
+
+        frame_state[index + i].swap_index = -1;
+    }
+
+    large_frame_free(index);
+
+    return 0;
 }
 
-/* Swap in a frame from backing store */
-int32_t swap_in(seL4_Word uaddr, seL4_Word sos_vaddr) {
+/*
+ * Check the large frame holding sos_vaddr can be split into small frames by its owner
+ * Returns 0 if it can be split now, 1 if the caller has to look at its page again
+ * (the frame was being written out) and -1 if it is pinned by a syscall in progress
+ */
+int32_t frame_split(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_head(sos_vaddr);
+    if ((frame_mask[index] & FRAME_LARGE) == 0) return 1;
+
+    if (frame_mask[index] & FRAME_BUSY) {
+        /* Being written out, wait for it to finish */
+        struct large_waiter *waiter = malloc(sizeof(struct large_waiter));
+        if (waiter == NULL) return -1;
+
+        waiter->pid = curproc->pid;
+        waiter->stime = curproc->stime;
+        waiter->coroutine_id = curr_coroutine_id;
+        waiter->next = large_waiters;
+        large_waiters = waiter;
+
+        yield();
+        return 1;
+    }
+
+    if ((frame_mask[index] & FRAME_SWAPPABLE) == 0) return -1;
+
+    return 0;
+}
+
+/* Finish swapping in a frame taken over from the swap cache, it already holds the page in swap_index */
+void swap_in_cached(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index) {
+    struct app_addrspace *as = curproc->addrspace;
+
+    swap_in_done(sos_vaddr, swap_index);
+
+    /* Mark it unswapped */
+    as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr &= (~PTE_SWAP);
+}
+
+/* Swap in a frame from backing store, swap_index is the slot its page table entry held */
+int32_t swap_in(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index) {
     int index1 = root_index(uaddr);
     int index2 = leaf_index(uaddr);
-    seL4_Word frame_index = frame_vaddr_to_index(sos_vaddr);
 
     /* Write page back in from swapfile */
     struct app_addrspace *as = curproc->addrspace;
-    uint32_t swap_index = as->swap_table[index1][index2].swap_index;
+
+    int err;
+    if (swap_cache_contains(swap_index) || zswap_contains(swap_index)) {
+        err = swap_in_slot(sos_vaddr, swap_index);
+    } else {
+        err = swap_in_readahead(uaddr, sos_vaddr, swap_index);
+    }
+    if (err) return -1;
+
+    /* Mark it unswapped */
+	seL4_Word mask = as->page_table[index1][index2].sos_vaddr & PAGE_MASK_4K;
+    as->page_table[index1][index2].sos_vaddr = (sos_vaddr | PTE_VALID | mask) & (~PTE_SWAP);
+
+    return 0;
+}
+
+/* Expand a page as stored in the pagefile into its frame */
+int32_t swap_unpack_page(uint8_t *data, uint32_t sectors, uint8_t *page) {
+    if (sectors == SWAP_PAGE_SECTORS) {
+        memcpy(page, data, PAGE_SIZE_4K);
+        return 0;
+    }
+
+    uint32_t len = data[0] | (data[1] << 8);
+    if (len + SWAP_HEADER_SIZE > sectors * SWAP_SECTOR_SIZE) return -1;
+
+    return page_decompress(data + SWAP_HEADER_SIZE, len, page);
+}
+
+/* The frame now holds the page in swap_index and keeps the slot until it is written to */
+static void swap_in_done(seL4_Word sos_vaddr, uint32_t swap_index) {
+    seL4_Word frame_index = frame_vaddr_to_index(PAGE_ALIGN_4K(sos_vaddr));
+
+    /* Keep the slot so the frame can be evicted again for free until it is written to */
+    frame_state[frame_index].swap_index = swap_index;
+    frame_mask[frame_index] &= (~FRAME_DIRTY);
+
+    seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
+}
+
+/*
+ * Read a private page together with the following pages of the process
+ * whose slots come straight after its own, as clustered swap out leaves
+ * them, in a single read. The extra pages wait in the swap cache for their
+ * own faults, which then need no I/O.
+ */
+static int32_t swap_in_readahead(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index) {
+    struct PCB *pcb = curproc;
+    struct app_addrspace *as = pcb->addrspace;
+    uint32_t sectors[SWAP_READAHEAD_MAX + 1];
+
+    sectors[0] = swap_index_sectors(swap_index);
+    if (sectors[0] == 0) return -1;
+
+    uint32_t count = 1;
+    uint32_t total = sectors[0];
+
+    /* Only read ahead while there is memory to spare */
+    uint32_t window = swap_cache_window();
+    if (frame_available() <= PAGEOUT_HIGH_WATERMARK + window) window = 0;
+
+    struct region *region = as_get_region(as, uaddr);
+    while (count <= window) {
+        seL4_Word next = uaddr + count * PAGE_SIZE_4K;
+        if (region == NULL || next >= region->baseaddr + region->size) break;
+        if (as->page_table[root_index(next)] == NULL) break;
+
+        seL4_Word pte = as->page_table[root_index(next)][leaf_index(next)].sos_vaddr;
+        if ((pte & PTE_SWAP) == 0 || (pte & (PTE_SHARED | PTE_BEINGSWAPPED))) break;
+        if (pte_index(pte) != swap_index + total) break;
+
+        /* Note: A page in the compressed pool may not have reached its slot yet */
+        if (swap_cache_contains(pte_index(pte)) || zswap_contains(pte_index(pte))) break;
+
+        sectors[count] = swap_index_sectors(pte_index(pte));
+        if (sectors[count] == 0) break;
+
+        total += sectors[count];
+        count++;
+    }
+
+    if (count == 1) return swap_in_slot(sos_vaddr, swap_index);
+
+    uint8_t *buf = malloc(total * SWAP_SECTOR_SIZE);
+    if (buf == NULL) return swap_in_slot(sos_vaddr, swap_index);
 
     struct uio uio = {
-        .vaddr = PAGE_ALIGN_4K(sos_vaddr),
+        .vaddr = (char *) buf,
         .uaddr = NULL,
-        .size = PAGE_SIZE_4K,
-        .offset = swap_index * PAGE_SIZE_4K,
-        .remaining = PAGE_SIZE_4K,
-        .pcb = curproc
+        .size = total * SWAP_SECTOR_SIZE,
+        .offset = swap_index * SWAP_SECTOR_SIZE,
+        .remaining = total * SWAP_SECTOR_SIZE,
+        .pcb = pcb
     };
 
-    
-
-    /* Swap in */
+    timestamp_t start = time_stamp();
     int err = swap_vnode->ops->vop_read(swap_vnode, &uio);
+    if (!err) err = swap_unpack_page(buf, sectors[0], (uint8_t *) PAGE_ALIGN_4K(sos_vaddr));
     if (err) {
+        free(buf);
         return -1;
     }
 
-    /* Mark it unswapped */
-	seL4_Word mask = as->page_table[index1][index2].sos_vaddr & PAGE_MASK_4K;
-    as->page_table[index1][index2].sos_vaddr = (sos_vaddr | PTE_VALID | mask) & (~PTE_SWAP);
+    swap_in_done(sos_vaddr, swap_index);
+    vm_stats.pages_in++;
+    vm_stats.swap_in_us += time_stamp() - start;
 
-    /* Mark page in swapfile as free */
-    free_swap_index(swap_index);
+    /* Cache the rest, unless they were faulted in, freed or reused while we read */
+    uint32_t offset = sectors[0];
+    for (uint32_t i = 1; i < count; i++) {
+        seL4_Word next = uaddr + i * PAGE_SIZE_4K;
+        uint32_t index = swap_index + offset;
+        offset += sectors[i];
 
-    seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
+        seL4_Word pte = as->page_table[root_index(next)][leaf_index(next)].sos_vaddr;
+        if ((pte & PTE_SWAP) == 0 || (pte & (PTE_SHARED | PTE_BEINGSWAPPED))) continue;
+        if (pte_index(pte) != index || swap_cache_contains(index) || zswap_contains(index)) continue;
 
+        if (frame_available() <= PAGEOUT_HIGH_WATERMARK) break;
+
+        seL4_Word frame_vaddr;
+        if (frame_alloc_flags(&frame_vaddr, FRAME_ALLOC_NOZERO)) break;
+
+        err = swap_unpack_page(buf + (offset - sectors[i]) * SWAP_SECTOR_SIZE, sectors[i],
+                (uint8_t *) frame_vaddr);
+        if (err || swap_cache_insert(index, frame_vaddr)) {
+            frame_free(frame_vaddr);
+        }
+    }
+
+    free(buf);
     return 0;
 }
 
-int32_t frame_alloc(seL4_Word *vaddr) {
+/* Read a pagefile slot into a frame, the frame keeps the slot until it is written to */
+int32_t swap_in_slot(seL4_Word sos_vaddr, uint32_t swap_index) {
+    uint8_t *page = (uint8_t *) PAGE_ALIGN_4K(sos_vaddr);
+
+    uint32_t sectors = swap_index_sectors(swap_index);
+    if (sectors == 0) return -1;
+
+    /* Read ahead already
+     * Note: Faults take read ahead frames over before allocating, this only
+     *       catches pages read ahead while the frame was being allocated */
+    seL4_Word cached = swap_cache_take(swap_index);
+    if (cached != 0) {
+        memcpy(page, (void *) cached, PAGE_SIZE_4K);
+        frame_free(cached);
+        swap_in_done(sos_vaddr, swap_index);
+        return 0;
+    }
+
+    /* Still in the compressed pool */
+    int on_disk;
+    if (zswap_load(swap_index, page, &on_disk) == 0) {
+        if (on_disk) {
+            swap_in_done(sos_vaddr, swap_index);
+            return 0;
+        }
+
+        /* The pool had the only copy, the frame is all that is left of the page */
+        free_swap_index(swap_index);
+
+        seL4_Word frame_index = frame_vaddr_to_index(PAGE_ALIGN_4K(sos_vaddr));
+        frame_state[frame_index].swap_index = -1;
+        frame_mask[frame_index] |= FRAME_DIRTY;
+
+        seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
+        return 0;
+    }
+
+    /* Compressed pages are read aside and expanded into the frame */
+    uint8_t *buf = NULL;
+    if (sectors < SWAP_PAGE_SECTORS) {
+        buf = malloc(sectors * SWAP_SECTOR_SIZE);
+        if (buf == NULL) return -1;
+    }
+
+    struct uio uio = {
+        .vaddr = (buf != NULL) ? (char *) buf : (char *) page,
+        .uaddr = NULL,
+        .size = sectors * SWAP_SECTOR_SIZE,
+        .offset = swap_index * SWAP_SECTOR_SIZE,
+        .remaining = sectors * SWAP_SECTOR_SIZE,
+        .pcb = curproc
+    };
+
+    /* Swap in */
+    timestamp_t start = time_stamp();
+    int err = swap_vnode->ops->vop_read(swap_vnode, &uio);
+    if (!err && buf != NULL) {
+        err = swap_unpack_page(buf, sectors, page);
+    }
+    free(buf);
+
+    if (err) {
+        return -1;
+    }
+
+    swap_in_done(sos_vaddr, swap_index);
+    vm_stats.pages_in++;
+    vm_stats.swap_in_us += time_stamp() - start;
+
+    return 0;
+}
+
+/* Allocate a frame, it is cleared unless FRAME_ALLOC_NOZERO is given */
+int32_t frame_alloc_flags(seL4_Word *vaddr, int flags) {
     int err;
     seL4_Word frame_vaddr;
 
     /* Initially set default return value as NULL */
     *vaddr = NULL;
 
-    if (free_index == EMPTY_FREELIST) {
+    if (frame_limit != 0 && frames_allocated - free_count >= frame_limit) {
+        /* Over the frame budget, make room in it */
+        return frame_alloc_swap(vaddr, flags);
+    }
+
+    if (free_index == EMPTY_FREELIST && zero_index == EMPTY_FREELIST) {
         /* Get untyped memory */
         seL4_Word frame_paddr = ut_alloc(seL4_PageBits);
-
-#ifdef LIMIT_FRAMES
-        /* Emulate limited frames up to MAX_FRAMES */
-        num_frames = MAX_FRAMES;
-        frames_to_alloc++;
-        if (frames_to_alloc > num_frames || frame_paddr == NULL) {
-#endif
-
-#ifndef LIMIT_FRAMES
         if (frame_paddr == NULL) {
-#endif
-            /* Out of memory, swap out a frame */
-            err = swap_out();
-            if (err) return -1;
-            
-            /* Note: get_free_frame() will not return NULL
-             *       since swap_out frees a frame
-             */
-            *vaddr = get_free_frame();
-
-            return 0;
+            out_of_frames = 1;
+            return frame_alloc_swap(vaddr, flags);
         }
 
         /* Retype to frame */
@@ -408,18 +1409,25 @@ int32_t frame_alloc(seL4_Word *vaddr) {
         /* Update frame details */
         uint32_t index = frame_paddr_to_index(frame_paddr);
         reset_frame_mask(index);
-        frame_table[index].cap = frame_cap;
+        frame_caps[index] = frame_cap;
+        frames_allocated++;
+
+        /* Clear frame */
+        if ((flags & FRAME_ALLOC_NOZERO) == 0) {
+            memset(frame_vaddr, 0, PAGE_SIZE);
+        }
 
     } else {
         /* Reuse a frame in the freelist */
-        frame_vaddr = get_free_frame();
+        frame_vaddr = get_free_frame(flags);
     }
 
-    /* Clear frame */
-    memset(frame_vaddr, 0, PAGE_SIZE);
-
     *vaddr = frame_vaddr;
 
+    if (frame_available() < PAGEOUT_LOW_WATERMARK) {
+        pageout_wakeup();
+    }
+
     return 0;
 }
 
@@ -427,34 +1435,124 @@ int32_t frame_free(seL4_Word vaddr) {
     uint32_t index = frame_vaddr_to_index(vaddr);
 
     /* Check that the frame was previously allocated */
-    if (frame_table[index].cap == seL4_CapNull) return -1;
+    if (frame_caps[index] == seL4_CapNull) return -1;
+
+    if (frame_mask[index] & FRAME_LARGE) {
+        /* Note: A large frame being written out is freed by the writer */
+        if ((frame_mask[index] & FRAME_BUSY) == 0) {
+            large_frame_free(index);
+        }
+        return 0;
+    }
+
+    /* Pagefile copy is no longer needed */
+    if (frame_state[index].swap_index >= 0) {
+        free_swap_index(frame_state[index].swap_index);
+        frame_state[index].swap_index = -1;
+    }
+
+    if (frame_mask[index] & FRAME_KERNEL) unswappable_count--;
 
     /* Set free list index */
-    frame_table[index].mask = 0;
-    frame_table[index].next_index = free_index;
+    frame_mask[index] = 0;
+    frame_state[index].next_index = free_index;
     free_index = index;
+    free_count++;
 
     return 0;
 }
 
-/* get free frame from free list */
-static seL4_Word get_free_frame() {
-    if (free_index == EMPTY_FREELIST) return NULL;
+/* Out of memory or over the budget, the page cleaner could not keep up so swap out a frame */
+static int32_t frame_alloc_swap(seL4_Word *vaddr, int flags) {
+    pageout_wakeup();
 
-    seL4_Word frame_vaddr = frame_index_to_vaddr(free_index);
+    for (int tries = 0; tries < SWAP_OUT_TRIES; tries++) {
+        /* Pages read ahead that nobody faulted on yet go before anything is written out */
+        if (swap_cache_shrink()) {
+            int err = swap_out();
+            if (err) return -1;
+        }
 
-    /* Reset the new frame mask */
-    reset_frame_mask(free_index);
-    
-    /* Update free index */
-    free_index = frame_table[free_index].next_index;
+        /* Note: Swapping yields and the frame it freed may be taken meanwhile, then go again */
+        *vaddr = get_free_frame(flags);
+        if (*vaddr != NULL) return 0;
+    }
 
-    /* Clear frame */
-    memset(frame_vaddr, 0, PAGE_SIZE);
+    return -1;
+}
+
+/* Number of frames that can be allocated without swapping */
+uint32_t frame_available() {
+    uint32_t available = out_of_frames ? free_count : UINT32_MAX;
+
+    if (frame_limit != 0) {
+        uint32_t in_use = frames_allocated - free_count;
+        uint32_t headroom = (in_use < frame_limit) ? frame_limit - in_use : 0;
+        if (headroom < available) available = headroom;
+    }
+
+    return available;
+}
+
+/*
+ * Change the frame budget, frames over a lowered budget are paged out in the background
+ * Note: The budget always leaves the pager room to reach its high watermark
+ *       on top of the frames that can never be paged out
+ */
+void frame_set_limit(uint32_t frames) {
+    if (frames != 0 && frames < unswappable_count + PAGEOUT_HIGH_WATERMARK) {
+        frames = unswappable_count + PAGEOUT_HIGH_WATERMARK;
+    }
+    frame_limit = frames;
+    pageout_wakeup();
+}
+
+/* get free frame from free list, preferring already cleared frames unless they are not needed */
+static seL4_Word get_free_frame(int flags) {
+    int32_t *list;
+    if (flags & FRAME_ALLOC_NOZERO) {
+        list = (free_index != EMPTY_FREELIST) ? &free_index : &zero_index;
+    } else {
+        list = (zero_index != EMPTY_FREELIST) ? &zero_index : &free_index;
+    }
+    if (*list == EMPTY_FREELIST) return NULL;
+
+    int32_t index = *list;
+    seL4_Word frame_vaddr = frame_index_to_vaddr(index);
+
+    /* Update free index */
+    *list = frame_state[index].next_index;
+    free_count--;
+
+    /* Reset the new frame mask
+     * Note: This clears share_id, which shares space with next_index */
+    reset_frame_mask(index);
+
+    if (list == &zero_index) {
+        zero_count--;
+    } else if ((flags & FRAME_ALLOC_NOZERO) == 0) {
+        /* Clear frame */
+        memset(frame_vaddr, 0, PAGE_SIZE);
+    }
 
     return frame_vaddr;
 }
 
+/* Clear a few freed frames ahead of time, called while there is nothing else to do */
+void frame_zero_refill() {
+    for (int i = 0; i < ZERO_POOL_BATCH; i++) {
+        if (zero_count >= ZERO_POOL_TARGET || free_index == EMPTY_FREELIST) return;
+
+        int32_t index = free_index;
+        memset(frame_index_to_vaddr(index), 0, PAGE_SIZE);
+
+        free_index = frame_state[index].next_index;
+        frame_state[index].next_index = zero_index;
+        zero_index = index;
+        zero_count++;
+    }
+}
+
 /* Set reference bit as well as make it unswappable */ 
 void pin_frame_entry(seL4_Word uaddr, seL4_Word size) {
     if (size <= 0) return;
@@ -475,13 +1573,16 @@ void pin_frame_entry(seL4_Word uaddr, seL4_Word size) {
         if (as->page_table[index1] == NULL) continue;
 
         sos_vaddr = as->page_table[index1][index2].sos_vaddr;
-        if ((sos_vaddr & PTE_SWAP) || (sos_vaddr & PTE_VALID) == 0) continue;
-
-        frame_index = frame_vaddr_to_index(sos_vaddr);
-        if ((frame_table[frame_index].mask & FRAME_VALID) &&
-            (frame_table[frame_index].mask & FRAME_SWAPPABLE)) {
-            frame_table[frame_index].mask |= FRAME_REFERENCE;
-			frame_table[frame_index].mask &= (~FRAME_SWAPPABLE);
+        if ((sos_vaddr & (PTE_SWAP | PTE_ZERO | PTE_IMAGE)) || (sos_vaddr & PTE_VALID) == 0) continue;
+
+        frame_index = frame_vaddr_to_head(sos_vaddr);
+        if (frame_mask[frame_index] & FRAME_BUSY) {
+            /* Large frame being written out, make sure it stays */
+            frame_mask[frame_index] |= (FRAME_DIRTY | FRAME_PINNED);
+        } else if ((frame_mask[frame_index] & FRAME_VALID) &&
+            (frame_mask[frame_index] & FRAME_SWAPPABLE)) {
+            frame_mask[frame_index] |= FRAME_REFERENCE;
+			frame_mask[frame_index] &= (~FRAME_SWAPPABLE);
         }
     }
 }
@@ -505,75 +1606,135 @@ void unpin_frame_entry(seL4_Word uaddr, seL4_Word size) {
         if (as->page_table[index1] == NULL) continue;
 
         sos_vaddr = as->page_table[index1][index2].sos_vaddr;
-        if ((sos_vaddr & PTE_SWAP) || (sos_vaddr & PTE_VALID) == 0) continue;
+        if ((sos_vaddr & (PTE_SWAP | PTE_ZERO | PTE_IMAGE)) || (sos_vaddr & PTE_VALID) == 0) continue;
 
-        frame_index = frame_vaddr_to_index(sos_vaddr);
-        if ((frame_table[frame_index].mask & FRAME_VALID)) {
-            frame_table[frame_index].mask |= FRAME_SWAPPABLE;
+        frame_index = frame_vaddr_to_head(sos_vaddr);
+        frame_mask[frame_index] &= (~FRAME_PINNED);
+        if ((frame_mask[frame_index] & FRAME_VALID) &&
+                (frame_mask[frame_index] & FRAME_BUSY) == 0) {
+            frame_mask[frame_index] |= FRAME_SWAPPABLE;
         }
     }
 }
 
 
 seL4_CPtr get_cap(seL4_Word vaddr) {
-    uint32_t index = frame_vaddr_to_index(PAGE_ALIGN_4K(vaddr));
-    return frame_table[index].cap;
+    uint32_t index = frame_vaddr_to_head(vaddr);
+    return frame_caps[index];
 }
 
 int32_t insert_app_cap(seL4_Word vaddr, seL4_CPtr cap,
         struct PCB *pcb, seL4_Word uaddr) {
 
-    uint32_t index = frame_vaddr_to_index(vaddr);
+    uint32_t index = frame_vaddr_to_head(vaddr);
 
     /* Check that the frame exists */
-    if (frame_table[index].cap == seL4_CapNull) return -1;
+    if (frame_caps[index] == seL4_CapNull) return -1;
+
+    struct app_cap *copied_cap = malloc(sizeof(struct app_cap));
+    if (copied_cap == NULL) return -1;
 
-    struct app_cap *copied_cap;
+    copied_cap->pcb = pcb;
+    copied_cap->uaddr = uaddr;
+    copied_cap->cap = cap;
 
-    /* Note: First app cap is not malloc'd */
-    if (frame_table[index].app_caps.cap == seL4_CapNull) {
-        /* First app cap */
-        copied_cap = &frame_table[index].app_caps;
+    if (frame_rmap[index] == NULL) {
+        /* The first mapper owns the frame */
         copied_cap->next = NULL;
-        copied_cap->pcb = pcb;
-        copied_cap->uaddr = uaddr;
-        copied_cap->cap = cap;
+        frame_rmap[index] = copied_cap;
+        frame_state[index].last_use = pcb->addrspace->fault_count;
+        pcb->addrspace->rss += frame_pieces(index);
     } else {
-        conditional_panic(1, "Does not currently support shared pages\n");
+        /* Shared frame, chain another mapper */
+        copied_cap->next = frame_rmap[index]->next;
+        frame_rmap[index]->next = copied_cap;
     }
 
     return 0;
 }
 
+/* Remove a mapper from a frame's chain
+ * Note: The cap itself must already be deleted */
+void remove_app_cap(seL4_Word vaddr, struct app_cap *cap) {
+    uint32_t index = frame_vaddr_to_head(vaddr);
+    struct app_cap *head = frame_rmap[index];
+    if (head == NULL) return;
+
+    if (cap == head) {
+        struct app_cap *next = head->next;
+
+        /* Ownership moves to the next mapper */
+        head->pcb->addrspace->rss -= frame_pieces(index);
+        if (next != NULL) {
+            next->pcb->addrspace->rss += frame_pieces(index);
+        }
+
+        frame_rmap[index] = next;
+        free(head);
+        return;
+    }
+
+    struct app_cap *prev = head;
+    while (prev->next != NULL && prev->next != cap) {
+        prev = prev->next;
+    }
+
+    if (prev->next == cap) {
+        prev->next = cap->next;
+        free(cap);
+    }
+}
+
 int32_t get_app_cap(seL4_Word vaddr,
         struct app_addrspace *as,
         struct app_cap **cap_ret) {
 
     struct page_table_entry **page_table = as->page_table;
 
-    uint32_t index = frame_vaddr_to_index(vaddr);
-    if (frame_table[index].cap == seL4_CapNull) return -1;
-
-    struct app_cap *curr_cap = &frame_table[index].app_caps;
+    uint32_t index = frame_vaddr_to_head(vaddr);
+    if (frame_caps[index] == seL4_CapNull) return -1;
 
-    if (curr_cap->cap == seL4_CapNull) {
-        return -1;
-    } else {
-        *cap_ret = curr_cap;
-        return 0;
+    /* Find the mapping belonging to this addrspace */
+    struct app_cap *curr_cap = frame_rmap[index];
+    while (curr_cap != NULL) {
+        if (curr_cap->pcb->addrspace == as) {
+            *cap_ret = curr_cap;
+            return 0;
+        }
+        curr_cap = curr_cap->next;
     }
+
+    return -1;
 }
 
 
 
 static void reset_frame_mask(uint32_t index) {
-    frame_table[index].mask = FRAME_SWAPPABLE | FRAME_VALID | FRAME_REFERENCE;
+    /* Note: New frames have no copy in the pagefile so start out dirty */
+    frame_mask[index] = FRAME_SWAPPABLE | FRAME_VALID | FRAME_REFERENCE | FRAME_DIRTY;
+    frame_state[index].last_use = 0;
+    frame_state[index].swap_index = -1;
+    frame_state[index].share_id = -1;
 }
 
 static inline uint32_t frame_vaddr_to_index(seL4_Word sos_vaddr) {
     return ((sos_vaddr - PROCESS_VMEM_START + low_addr - base_addr) >> INDEX_ADDR_OFFSET);
 }
 
+/* Index of the entry tracking the frame, the first one for a large frame */
+static inline uint32_t frame_vaddr_to_head(seL4_Word sos_vaddr) {
+    uint32_t index = frame_vaddr_to_index(PAGE_ALIGN_4K(sos_vaddr));
+    if ((frame_mask[index] & (FRAME_LARGE | FRAME_VALID)) == FRAME_LARGE) {
+        return frame_state[index].next_index;
+    }
+    return index;
+}
+
+/* Small frames a frame table entry accounts for */
+static inline uint32_t frame_pieces(uint32_t index) {
+    return (frame_mask[index] & FRAME_LARGE) ? LARGE_PAGE_FRAMES : 1;
+}
+
 static inline seL4_Word frame_index_to_vaddr(uint32_t index) {
     return ((index << INDEX_ADDR_OFFSET) + base_addr - low_addr + PROCESS_VMEM_START);
 }
@@ -588,7 +1749,21 @@ static inline uint32_t frame_paddr_to_index(seL4_Word paddr) {
 
 void set_fe_pid(seL4_Word sos_vaddr,seL4_Word pid){
     seL4_Word frame_index = frame_vaddr_to_index(sos_vaddr);   
-    frame_table[frame_index].mask &= (~FRAME_PID_MASK);
-    frame_table[frame_index].mask |= (pid << PID_SHIFT);
+    frame_mask[frame_index] &= (~FRAME_PID_MASK);
+    frame_mask[frame_index] |= (pid << PID_SHIFT);
+
+}
+
+void frame_vm_stats(sos_vm_stats_t *stats) {
+    *stats = vm_stats;
+    swap_cache_stats(stats);
+    zswap_stats(stats);
+}
+
+void set_frame_share(seL4_Word sos_vaddr, int32_t share_id) {
+    frame_state[frame_vaddr_to_index(PAGE_ALIGN_4K(sos_vaddr))].share_id = share_id;
+}
 
+int32_t get_frame_share(seL4_Word sos_vaddr) {
+    return frame_state[frame_vaddr_to_index(PAGE_ALIGN_4K(sos_vaddr))].share_id;
 }
@@ -1,8 +1,20 @@
 #ifndef _FRAMETABLE_H_
 #define _FRAMETABLE_H_
 
+#include <sos.h>
+
 #include "addrspace.h"
 #include "process.h"
+
+/* Large frames are 64K, made up of 16 small frame table entries */
+#define LARGE_PAGE_BITS 16
+#define LARGE_PAGE_SIZE (1 << LARGE_PAGE_BITS)
+#define LARGE_PAGE_FRAMES (1 << (LARGE_PAGE_BITS - seL4_PageBits))
+#define PAGE_ALIGN_LARGE(addr) ((addr) & ~(LARGE_PAGE_SIZE - 1))
+
+/* frame_alloc_flags flags */
+#define FRAME_ALLOC_NOZERO (1 << 0) /* Caller overwrites the whole frame */
+
 struct app_cap {
     struct PCB *pcb;
     seL4_Word uaddr;
@@ -15,17 +27,43 @@ void unpin_frame_entry(seL4_Word uaddr, seL4_Word size);
 void frame_init();
 
 int32_t frame_alloc(seL4_Word *vaddr);
+int32_t frame_alloc_flags(seL4_Word *vaddr, int flags);
 int32_t unswappable_alloc(seL4_Word *vaddr);
+int32_t large_frame_alloc(seL4_Word *vaddr);
 
 int32_t frame_free(seL4_Word vaddr);
 
+uint32_t frame_available();
+void frame_set_limit(uint32_t frames);
+
+void frame_zero_refill();
+
+void frame_vm_stats(sos_vm_stats_t *stats);
+
 seL4_CPtr get_cap(seL4_Word vaddr);
 
 int32_t insert_app_cap(seL4_Word vaddr, seL4_CPtr cap, struct PCB *pcb,seL4_Word uaddr);
 
 int32_t get_app_cap(seL4_Word vaddr, struct app_addrspace *as, struct app_cap **cap_ret);
 
-int32_t swap_in(seL4_Word uaddr, seL4_Word sos_vaddr);
+void remove_app_cap(seL4_Word vaddr, struct app_cap *cap);
+
+void reference_frame_entry(seL4_Word sos_vaddr);
+void dirty_frame_entry(seL4_Word sos_vaddr);
+void clean_frame_entry(seL4_Word sos_vaddr);
+int is_frame_dirty(seL4_Word sos_vaddr);
+
+int32_t swap_in(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index);
+int32_t swap_in_slot(seL4_Word sos_vaddr, uint32_t swap_index);
+void swap_in_cached(seL4_Word uaddr, seL4_Word sos_vaddr, uint32_t swap_index);
+uint32_t swap_pack_page(uint8_t *page, uint8_t *out);
+int32_t swap_unpack_page(uint8_t *data, uint32_t sectors, uint8_t *page);
 int32_t swap_out();
+int32_t swap_out_owner(struct app_addrspace *owner);
+int32_t frame_sync_page(seL4_Word uaddr, struct PCB *pcb, struct region *region);
+int32_t frame_split(seL4_Word sos_vaddr);
 void set_fe_pid(seL4_Word sos_vaddr,seL4_Word pid);
+
+void set_frame_share(seL4_Word sos_vaddr, int32_t share_id);
+int32_t get_frame_share(seL4_Word sos_vaddr);
 #endif /* _FRAMETABLE_H_ */
@@ -38,6 +38,8 @@
 #include "vnode.h"
 #include "console.h"
 #include "coroutine.h"
+#include "pageout.h"
+#include "zswap.h"
 
 #define verbose -1
 #include <sys/debug.h>
@@ -59,6 +61,9 @@
 
 #define NFS_TIMEOUT_INTERVAL 100000 /* Microseconds */
 
+/* Write not read bit of the data fault status register */
+#define FSR_WRITE (1 << 11)
+
 /* The linker will link this symbol to the start address  *
  * of an archive of attached applications.                */
 extern char _cpio_archive[];
@@ -86,6 +91,8 @@ static void vm_fault_handler(seL4_Word badge, int num_args) {
     seL4_Word sos_vaddr, map_vaddr, instruction_vaddr;
 
     int isInstruction = seL4_GetMR(2);
+    /* Note: Read before mapping since the IPC buffer is reused if we yield */
+    int isWrite = !isInstruction && (seL4_GetMR(3) & FSR_WRITE);
     /* Check whether instruction fault or data fault */
     if (isInstruction) {
         /* Instruction fault */
@@ -99,10 +106,40 @@ static void vm_fault_handler(seL4_Word badge, int num_args) {
         pin_frame_entry(PAGE_ALIGN_4K(instruction_vaddr), PAGE_SIZE_4K);
     }
 
-    err = sos_map_page(map_vaddr, &sos_vaddr, curproc);
+    /* Advance the process' virtual time */
+    curproc->addrspace->fault_count++;
+
+    /* Code and read-only data of programs from the cpio archive are mapped in place */
+    err = 1;
+    if (!isWrite) {
+        err = sos_map_image_page(map_vaddr, curproc);
+    }
+
+    /* Reads of untouched anonymous memory share the zero frame */
+    if (err > 0 && !isInstruction && !isWrite) {
+        err = sos_map_zero_page(map_vaddr, curproc);
+    }
+
+    int mapped = 0;
+    if (err > 0) {
+        err = sos_map_page(map_vaddr, &sos_vaddr, curproc);
+        mapped = (err == 0);
+    }
+    if (isWrite && (err == ERR_ALREADY_MAPPED || (err == 0 && !sos_page_writable(map_vaddr, curproc)))) {
+        /* Write to a clean or copy-on-write page which was mapped read-only */
+        err = sos_dirty_page(map_vaddr, curproc);
+    }
     if (err) {
         process_destroy(curproc->pid);
     } else {
+        if (mapped) {
+            /* Map the neighbours too if the process is scanning through memory */
+            if (sos_fault_around(map_vaddr, curproc)) {
+                cspace_free_slot(cur_cspace, reply_cap);
+                return;
+            }
+        }
+
         if (!isInstruction) {
             unpin_frame_entry(PAGE_ALIGN_4K(instruction_vaddr), PAGE_SIZE_4K);
         }
@@ -120,6 +157,12 @@ void syscall_loop(seL4_CPtr ep) {
     seL4_Word badge;
     seL4_Word label;
     seL4_MessageInfo_t message;
+
+    /* Start the page cleaner, it returns here the first time it sleeps */
+    if (setjmp(syscall_loop_entry) == 0) {
+        pageout_start();
+    }
+
     while (1) {
         entry = setjmp(syscall_loop_entry); 
 
@@ -131,6 +174,9 @@ void syscall_loop(seL4_CPtr ep) {
         cleanup_coroutine();
         resume();
 
+        /* Nothing left to run, clear some free frames before blocking */
+        frame_zero_refill();
+
         message = seL4_Wait(ep, &badge);
         label = seL4_MessageInfo_get_label(message);
 
@@ -295,6 +341,9 @@ static void _sos_init(seL4_CPtr* ipc_ep, seL4_CPtr* async_ep){
     /* Initialise frame table */
     frame_init(high,low);
 
+    /* Set aside the compressed swap pool */
+    zswap_init();
+
     /* Initialise vfs */
     vfs_init();
 
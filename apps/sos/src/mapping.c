@@ -8,6 +8,7 @@
  * @TAG(NICTA_BSD)
  */
 
+#include <string.h>
 #include <elf/elf.h>
 
 #include "mapping.h"
@@ -19,15 +20,30 @@
 #include "addrspace.h"
 #include "frametable.h"
 #include "process.h"
+#include "share_vm.h"
+#include "pageout.h"
+#include "working_set.h"
+#include "swap_cache.h"
+#include "vnode.h"
 
 #include <sys/panic.h>
 #include <sys/debug.h>
 #include <cspace/cspace.h>
 
 extern const seL4_BootInfo *_boot_info;
+extern char __executable_start[];
 extern struct PCB *curproc;
 extern uint32_t curr_swap_offset;
 
+/* Read by every untouched anonymous page until it is written */
+static seL4_Word zero_frame = 0;
+
+/* Mapping flags */
+#define MAP_PREFETCH (1 << 0) /* Speculative, not demand seen by the working set manager */
+#define MAP_READ (1 << 1) /* SOS only reads the page, zero and image frames are used in place */
+
+static int sos_map_page_flags(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pcb, int flags);
+
 /**
  * Maps a page table into the root servers page directory
  * @param vaddr The virtual address of the mapping
@@ -121,12 +137,268 @@ int sos_unmap_page(seL4_Word vaddr, struct app_addrspace *as) {
 
     err = cspace_delete_cap(cur_cspace, cap->cap);
 
-    cap->cap = seL4_CapNull;
+    remove_app_cap(PAGE_ALIGN_4K(vaddr), cap);
     return err;
 }
 
+/*
+ * Rights a resident page is mapped with
+ * Note: Write access is withheld from clean frames so the first write is
+ *       caught, and from shared pages other sharers did not make writable
+ */
+static seL4_CapRights page_rights(struct region *region, seL4_Word uaddr,
+        seL4_Word sos_vaddr, struct PCB *pcb) {
+    seL4_CapRights rights = region->permissions;
+
+    if (!is_frame_dirty(sos_vaddr)) {
+        rights &= (~seL4_CanWrite);
+    }
+    if ((sos_vaddr & PTE_SHARED) && !share_can_write(uaddr, pcb)) {
+        rights &= (~seL4_CanWrite);
+    }
+
+    return rights;
+}
+
+/* Whether pcb's resident page at uaddr is currently mapped writable */
+int sos_page_writable(seL4_Word uaddr, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+
+    struct region *region = as_get_region(as, uaddr);
+    if (region == NULL) return 0;
+
+    seL4_Word sos_vaddr = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+    if ((sos_vaddr & PTE_VALID) == 0 || (sos_vaddr & (PTE_SWAP | PTE_ZERO | PTE_IMAGE))) return 0;
+
+    return (page_rights(region, PAGE_ALIGN_4K(uaddr), sos_vaddr, pcb) & seL4_CanWrite) != 0;
+}
+
+/* Allocate the page table pages covering uaddr if missing */
+int sos_page_table_alloc(struct app_addrspace *as, seL4_Word uaddr) {
+    int index1 = root_index(uaddr);
+    int err;
+
+    if (as->page_table == NULL) {
+        /* First level */
+        err = unswappable_alloc((seL4_Word *) &as->page_table);
+        if (err) return ERR_NO_MEMORY;
+    }
+
+    if (as->page_table[index1] == NULL) {
+        /* Second level */
+        err = unswappable_alloc((seL4_Word *) &as->page_table[index1]);
+        if (err) return ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+/* Set and clear bits of the entry for uaddr, or of every piece if it is part of a large frame */
+void sos_pte_update(struct app_addrspace *as, seL4_Word uaddr, seL4_Word set, seL4_Word clear) {
+    int pieces = 1;
+
+    if (as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr & PTE_LARGE) {
+        uaddr = PAGE_ALIGN_LARGE(uaddr);
+        pieces = LARGE_PAGE_FRAMES;
+    }
+
+    for (int i = 0; i < pieces; i++) {
+        struct page_table_entry *pte = &as->page_table[root_index(uaddr)][leaf_index(uaddr)];
+        pte->sos_vaddr = (pte->sos_vaddr | set) & (~clear);
+        uaddr += PAGE_SIZE_4K;
+    }
+}
+
+/*
+ * Back the untouched 64K block around uaddr with a large frame
+ * Note: Fails (and the caller falls back to a small frame) if the block
+ *       is not inside the region, any of it is in use or memory is short
+ */
+static int sos_map_large_page(seL4_Word uaddr, struct PCB *pcb,
+        struct region *region, seL4_Word *sos_vaddr_ret) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word base = PAGE_ALIGN_LARGE(uaddr);
+    int err;
+
+    if (base < region->baseaddr || base + LARGE_PAGE_SIZE > region->baseaddr + region->size) {
+        return -1;
+    }
+
+    /* Note: A large block never crosses a second level page table */
+    struct page_table_entry *ptes = &as->page_table[root_index(base)][leaf_index(base)];
+    for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+        if (ptes[i].sos_vaddr != 0) return -1;
+    }
+
+    seL4_Word frame_vaddr;
+    err = large_frame_alloc(&frame_vaddr);
+    if (err) return -1;
+
+    seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+            cur_cspace,
+            get_cap(frame_vaddr),
+            seL4_AllRights);
+
+    err = map_page(copied_cap,
+            pcb->vroot,
+            base,
+            region->permissions,
+            seL4_ARM_Default_VMAttributes);
+    if (err) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        frame_free(frame_vaddr);
+        return -1;
+    }
+
+    err = insert_app_cap(frame_vaddr, copied_cap, pcb, base);
+    if (err) {
+        seL4_ARM_Page_Unmap(copied_cap);
+        cspace_delete_cap(cur_cspace, copied_cap);
+        frame_free(frame_vaddr);
+        return -1;
+    }
+
+    /* Each piece points at its own 4K of the frame */
+    for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+        ptes[i].sos_vaddr = (frame_vaddr + i * PAGE_SIZE_4K) | region->permissions | PTE_VALID | PTE_LARGE;
+    }
+
+    as->page_count += LARGE_PAGE_FRAMES;
+
+    *sos_vaddr_ret = frame_vaddr + (uaddr - base);
+    return 0;
+}
+
+/*
+ * Make sure pcb's page at uaddr is a small page, copying each piece of its large frame into a small frame
+ * Note: The copies are left soft so the next access maps them, nothing goes through the pagefile
+ */
+int sos_split_page(seL4_Word uaddr, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word copies[LARGE_PAGE_FRAMES];
+    int err;
+
+    if (as->page_table == NULL || as->page_table[root_index(uaddr)] == NULL) return 0;
+
+    seL4_Word base = PAGE_ALIGN_LARGE(uaddr);
+    struct page_table_entry *ptes = &as->page_table[root_index(base)][leaf_index(base)];
+
+    while (1) {
+        if ((ptes[0].sos_vaddr & PTE_LARGE) == 0) return 0;
+
+        /* Note: Waiting for the frame to be written out yields */
+        err = frame_split(PAGE_ALIGN_4K(ptes[0].sos_vaddr));
+        if (err < 0) return ERR_NO_MEMORY;
+        if (err > 0) continue;
+
+        int count = 0;
+        for (; count < LARGE_PAGE_FRAMES; count++) {
+            if (frame_alloc_flags(&copies[count], FRAME_ALLOC_NOZERO)) break;
+        }
+
+        /* Note: Allocating may have yielded and the frame may be busy or gone by now */
+        if (count == LARGE_PAGE_FRAMES && (ptes[0].sos_vaddr & PTE_LARGE) &&
+                frame_split(PAGE_ALIGN_4K(ptes[0].sos_vaddr)) == 0) {
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            frame_free(copies[i]);
+        }
+        if (count < LARGE_PAGE_FRAMES) return ERR_NO_MEMORY;
+    }
+
+    seL4_Word frame_vaddr = PAGE_ALIGN_4K(ptes[0].sos_vaddr);
+    sos_unmap_page(frame_vaddr, as);
+
+    for (int i = 0; i < LARGE_PAGE_FRAMES; i++) {
+        memcpy((void *) copies[i], (void *) (frame_vaddr + i * PAGE_SIZE_4K), PAGE_SIZE_4K);
+        seL4_ARM_Page_Unify_Instruction(get_cap(copies[i]), 0, PAGE_SIZE_4K);
+
+        seL4_Word mask = ptes[i].sos_vaddr & PAGE_MASK_4K & (~PTE_LARGE);
+        ptes[i].sos_vaddr = copies[i] | mask | PTE_SOFT;
+    }
+
+    frame_free(frame_vaddr);
+
+    return 0;
+}
+
+/* Wait for pcb's page at uaddr to finish being written out without reading it back in */
+void sos_wait_page(seL4_Word uaddr, struct PCB *pcb) {
+    struct page_table_entry *pte = &pcb->addrspace->page_table[root_index(uaddr)][leaf_index(uaddr)];
+    if ((pte->sos_vaddr & PTE_BEINGSWAPPED) == 0) return;
+
+    set_fe_pid(PAGE_ALIGN_4K(pte->sos_vaddr), pcb->pid);
+    pte->sos_vaddr &= (~PTE_BEINGSWAPPED);
+    yield();
+}
+
+/*
+ * Read the part of a file or image backed region's page at uaddr into its new frame
+ * Note: The frame was cleared so anything past the file's bytes reads as zero
+ */
+static int sos_fill_page(seL4_Word uaddr, seL4_Word sos_vaddr, struct region *region, struct PCB *pcb) {
+    seL4_Word start = uaddr;
+    seL4_Word end = uaddr + PAGE_SIZE_4K;
+    if (start < region->baseaddr) start = region->baseaddr;
+    if (end > region->baseaddr + region->file_size) end = region->baseaddr + region->file_size;
+
+    if (start < end && region->image != NULL) {
+        memcpy((void *) (sos_vaddr + (start - uaddr)), region->image + (start - region->baseaddr), end - start);
+    } else if (start < end) {
+        struct uio uio = {
+            .uaddr = NULL,
+            .vaddr = sos_vaddr + (start - uaddr),
+            .size = end - start,
+            .remaining = end - start,
+            .offset = region->file_offset + (start - region->baseaddr),
+            .pcb = pcb
+        };
+
+        int err = region->vnode->ops->vop_read(region->vnode, &uio);
+        if (err) return ERR_FILE_READ;
+    }
+
+    /* Not observable to I-cache yet so flush the frame */
+    seL4_ARM_Page_Unify_Instruction(get_cap(sos_vaddr), 0, PAGE_SIZE_4K);
+
+    return 0;
+}
+
+/*
+ * Write the part of a written back region's page at uaddr held in the frame at sos_vaddr to its file
+ * Note: The region's file reference keeps the vnode around for the write
+ */
+int sos_write_page(seL4_Word uaddr, seL4_Word sos_vaddr, struct region *region, struct PCB *pcb) {
+    seL4_Word start = uaddr;
+    seL4_Word end = uaddr + PAGE_SIZE_4K;
+    if (start < region->baseaddr) start = region->baseaddr;
+    if (end > region->baseaddr + region->file_size) end = region->baseaddr + region->file_size;
+    if (start >= end) return 0;
+
+    struct uio uio = {
+        .uaddr = NULL,
+        .vaddr = sos_vaddr + (start - uaddr),
+        .size = end - start,
+        .remaining = end - start,
+        .offset = region->file_offset + (start - region->baseaddr),
+        .pcb = pcb
+    };
+
+    int err = region->vnode->ops->vop_write(region->vnode, &uio);
+    if (err) return ERR_FILE_WRITE;
+
+    return 0;
+}
+
 int
 sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pcb) {
+    return sos_map_page_flags(uaddr_unaligned, sos_vaddr_ret, pcb, 0);
+}
+
+static int
+sos_map_page_flags(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pcb, int flags) {
     seL4_ARM_PageDirectory pd = pcb->vroot;
     struct app_addrspace *as = pcb->addrspace;
     int err;
@@ -134,7 +406,6 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     seL4_Word uaddr = PAGE_ALIGN_4K(uaddr_unaligned);
     /* Get the addr to simplify later implementation */
     struct page_table_entry ***page_table = &(as->page_table);
-    struct swap_table_entry ***swap_table = &(as->swap_table);
     /* Invalid mapping NULL */
     if (((void *) uaddr) == NULL) {
         return ERR_INVALID_ADDR;
@@ -144,14 +415,7 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     int index2 = leaf_index(uaddr);
 
     /* Checking with the region the check the permission */
-    struct region *curr_region = as->regions;
-    while (curr_region != NULL) {
-        if (uaddr_unaligned >= curr_region->baseaddr &&
-                uaddr_unaligned < curr_region->baseaddr + curr_region->size) {
-            break;
-        }
-        curr_region = curr_region->next;
-    }
+    struct region *curr_region = as_get_region(as, uaddr_unaligned);
 
     /* Can't find the region that contains this uaddr */
     if (curr_region == NULL) {
@@ -159,59 +423,126 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     }
 
     /* No page table yet */
-    if (*page_table == NULL) {
-        /* First level */
-        err = unswappable_alloc((seL4_Word *) page_table);
-        if (err) return ERR_NO_MEMORY;
+    err = sos_page_table_alloc(as, uaddr);
+    if (err) return err;
 
-        err = unswappable_alloc((seL4_Word *) swap_table);
-        if (err) {
-            frame_free(page_table);
-            return ERR_NO_MEMORY;
+    seL4_Word pte_before = (*page_table)[index1][index2].sos_vaddr;
+    if ((pte_before & (PTE_ZERO | PTE_IMAGE)) && (flags & MAP_READ)) {
+        /* Note: Image pages lie page aligned in SOS's own image */
+        if (pte_before & PTE_ZERO) {
+            *sos_vaddr_ret = zero_frame;
+        } else {
+            *sos_vaddr_ret = (seL4_Word) curr_region->image + (uaddr - curr_region->baseaddr);
         }
+        return ERR_ALREADY_MAPPED;
+    }
 
-        /* Second level */
-        err = unswappable_alloc((seL4_Word *) &(*page_table)[index1]);
-
-        if (err) {
-            frame_free(page_table);
-            frame_free(swap_table);
-            return ERR_NO_MEMORY;
+    /* Pages that need a frame are demand seen by the working set manager */
+    int over_quota = 0;
+    if (pte_before == 0 || (pte_before & (PTE_SWAP | PTE_ZERO | PTE_IMAGE))) {
+        if ((flags & MAP_PREFETCH) == 0) as->page_ins++;
+
+        seL4_Word limit = ws_limit(as);
+        over_quota = (limit != 0 && as->rss >= limit);
+        if (over_quota && (flags & MAP_PREFETCH) == 0 && uaddr < PROCESS_IPC_BUFFER) {
+            /* At the resident set limit or working set target, make room by paging out one of our own
+             * Note: The quota is soft, if none of ours can go the frame comes from the global pool.
+             *       Paging out may yield, so the entry and region are only read afterwards */
+            swap_out_owner(as);
+
+            curr_region = as_get_region(as, uaddr_unaligned);
+            if (curr_region == NULL) return ERR_INVALID_REGION;
         }
+    }
 
-        err = unswappable_alloc((seL4_Word *) &(*swap_table)[index1]);
-        if (err) {
-            frame_free(page_table);
-            frame_free(swap_table);
-            frame_free(&(*page_table)[index1]);
-            return ERR_NO_MEMORY;
-        }
+    seL4_Word curr_sos_vaddr = (*page_table)[index1][index2].sos_vaddr;
+    if (curr_sos_vaddr & (PTE_ZERO | PTE_IMAGE)) {
+        /* Anyone but readers wants a frame of their own to write to, image pages are copied into it */
+        sos_unmap_zero_page(uaddr, as);
+        curr_sos_vaddr = 0;
+    }
 
-    } else if ((*page_table)[index1] == NULL) {
-        /* Second level */
-        err = unswappable_alloc((seL4_Word *) &(*page_table)[index1]);
-        if (err) return ERR_NO_MEMORY;
+    if ((seL4_Word *) curr_sos_vaddr != NULL) {
+        if ((curr_sos_vaddr & PTE_SWAP) == 0 && (curr_sos_vaddr & PTE_SOFT)) {
+            /* Soft fault - frame is still resident, map it back in */
+            seL4_CapRights rights = page_rights(curr_region, uaddr, curr_sos_vaddr, pcb);
+
+            seL4_Word map_uaddr = uaddr;
+            if (curr_sos_vaddr & PTE_LARGE) {
+                map_uaddr = PAGE_ALIGN_LARGE(uaddr);
+            }
+
+            struct app_cap *app_cap;
+            err = get_app_cap(PAGE_ALIGN_4K(curr_sos_vaddr), as, &app_cap);
+            if (err) {
+                /* Resident but never mapped by us, eg. handed over from a share */
+                seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+                        cur_cspace,
+                        get_cap(PAGE_ALIGN_4K(curr_sos_vaddr)),
+                        seL4_AllRights);
+                err = insert_app_cap(PAGE_ALIGN_4K(curr_sos_vaddr), copied_cap, pcb, uaddr);
+                if (err) {
+                    cspace_delete_cap(cur_cspace, copied_cap);
+                    return ERR_NO_MEMORY;
+                }
+                get_app_cap(PAGE_ALIGN_4K(curr_sos_vaddr), as, &app_cap);
+            }
+
+            err = map_page(app_cap->cap,
+                    pd,
+                    map_uaddr,
+                    rights,
+                    seL4_ARM_Default_VMAttributes);
+            if (err) return ERR_INTERNAL_MAP_ERROR;
+
+            sos_pte_update(as, uaddr, 0, PTE_SOFT);
+            reference_frame_entry(curr_sos_vaddr);
 
-        err = unswappable_alloc((seL4_Word *) &(*swap_table)[index1]);
-        if (err) {
-            frame_free(&(*page_table)[index1]);
-            return ERR_NO_MEMORY;
+            *sos_vaddr_ret = (*page_table)[index1][index2].sos_vaddr;
+            return 0;
         }
-    }
 
-    seL4_Word curr_sos_vaddr = (*page_table)[index1][index2].sos_vaddr;
-    if ((seL4_Word *) curr_sos_vaddr != NULL) {
         if ((curr_sos_vaddr & PTE_SWAP) == 0) {
             /* Already mapped */
             *sos_vaddr_ret = (*page_table)[index1][index2].sos_vaddr;
             return ERR_ALREADY_MAPPED;
         }
+
+        if (curr_sos_vaddr & PTE_SHARED) {
+            /* Frame and swap slot belong to the share */
+            return share_map_page(uaddr, pcb, curr_region, sos_vaddr_ret);
+        }
+    }
+
+    int file_shared = (curr_sos_vaddr == 0 && curr_region->vnode != NULL &&
+            (curr_region->permissions & seL4_CanWrite) == 0);
+    if (file_shared) {
+        /* Text and read-only data may already be in memory for another process running the file */
+        err = share_file_page(uaddr, pcb, curr_region, sos_vaddr_ret);
+        if (err <= 0) return err;
+    }
+
+    if (curr_sos_vaddr == 0 && !over_quota && (curr_region->flags & REGION_LARGE_PAGES)) {
+        /* Untouched page in a region that prefers large frames */
+        err = sos_map_large_page(uaddr, pcb, curr_region, sos_vaddr_ret);
+        if (!err) return 0;
     }
 
     /* Call the internal kernel page mapping */
-    seL4_Word new_frame_vaddr;
-    if (uaddr >= PROCESS_IPC_BUFFER) {
+    seL4_Word new_frame_vaddr = 0;
+    if ((curr_sos_vaddr & PTE_SWAP) && (curr_sos_vaddr & PTE_BEINGSWAPPED) == 0) {
+        /* Read ahead already, the frame it was read into becomes ours */
+        new_frame_vaddr = swap_cache_take(pte_index(curr_sos_vaddr));
+    }
+    int cached = (new_frame_vaddr != 0);
+
+    if (cached) {
+        err = 0;
+    } else if (uaddr >= PROCESS_IPC_BUFFER) {
         err = unswappable_alloc(&new_frame_vaddr);
+    } else if (curr_sos_vaddr & PTE_SWAP) {
+        /* Contents come from the pagefile */
+        err = frame_alloc_flags(&new_frame_vaddr, FRAME_ALLOC_NOZERO);
     } else {
         err = frame_alloc(&new_frame_vaddr);
     }
@@ -226,10 +557,16 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
             cap,
             seL4_AllRights);
 
+    /* Pages coming back from the pagefile or their file start out clean so map them read-only */
+    seL4_CapRights rights = curr_region->permissions;
+    if ((curr_sos_vaddr & PTE_SWAP) || (curr_region->flags & REGION_WRITEBACK)) {
+        rights &= (~seL4_CanWrite);
+    }
+
     err = map_page(copied_cap,
             pd,
             uaddr,
-            curr_region->permissions,
+            rights,
             seL4_ARM_Default_VMAttributes);
     if (err) {
         cspace_delete_cap(cur_cspace, copied_cap);
@@ -238,15 +575,28 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     }
 
     /* Book keeping the copied caps */
-    insert_app_cap(PAGE_ALIGN_4K(new_frame_vaddr),
+    err = insert_app_cap(PAGE_ALIGN_4K(new_frame_vaddr),
             copied_cap,
             pcb,
             uaddr);
-   
+    if (err) {
+        seL4_ARM_Page_Unmap(copied_cap);
+        cspace_delete_cap(cur_cspace, copied_cap);
+        frame_free(new_frame_vaddr);
+        return ERR_NO_MEMORY;
+    }
+
     if ((*page_table)[index1][index2].sos_vaddr & PTE_BEINGSWAPPED) {
         set_fe_pid(PAGE_ALIGN_4K(curr_sos_vaddr),pcb->pid); 
         as->page_table[index1][index2].sos_vaddr &= (~PTE_BEINGSWAPPED);
         yield();
+
+        if ((*page_table)[index1][index2].sos_vaddr & PTE_SOFT) {
+            /* The write failed and the old frame was handed back, use it instead */
+            sos_unmap_page(new_frame_vaddr, as);
+            frame_free(new_frame_vaddr);
+            return sos_map_page_flags(uaddr_unaligned, sos_vaddr_ret, pcb, flags);
+        }
     }
 
 
@@ -261,8 +611,23 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     struct page_table_entry pte = {PAGE_ALIGN_4K(new_frame_vaddr) | mask};
     (*page_table)[index1][index2] = pte;
 
-    if (pte.sos_vaddr & PTE_SWAP) {
-        swap_in(uaddr, PAGE_ALIGN_4K(new_frame_vaddr));
+    if ((pte.sos_vaddr & PTE_SWAP) && cached) {
+        swap_in_cached(uaddr, PAGE_ALIGN_4K(new_frame_vaddr), pte_index(curr_sos_vaddr));
+    } else if (pte.sos_vaddr & PTE_SWAP) {
+        err = swap_in(uaddr, PAGE_ALIGN_4K(new_frame_vaddr), pte_index(curr_sos_vaddr));
+        if (err) {
+            /* Frame was not cleared, don't leak its old contents */
+            memset((void *) PAGE_ALIGN_4K(new_frame_vaddr), 0, PAGE_SIZE_4K);
+        }
+    } else if (curr_sos_vaddr == 0 && (curr_region->vnode != NULL || curr_region->image != NULL)) {
+        /* First touch of a file or image backed page */
+        err = sos_fill_page(uaddr, PAGE_ALIGN_4K(new_frame_vaddr), curr_region, pcb);
+        if (err) return err;
+
+        if (file_shared) share_file_add(uaddr, pcb, curr_region);
+
+        /* Matches its file until written to */
+        if (curr_region->flags & REGION_WRITEBACK) clean_frame_entry(new_frame_vaddr);
     }
 
     *sos_vaddr_ret = new_frame_vaddr;
@@ -270,6 +635,315 @@ sos_map_page(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pc
     return 0;
 }
 
+/*
+ * Map the zero frame read-only at uaddr for a read fault on an untouched
+ * anonymous page, so the page takes no memory until it is written.
+ * The entry keeps the cap of the mapping, sos_map_page replaces it with a
+ * frame of its own on the first write.
+ * Returns 1 if the page does not qualify and has to be mapped with sos_map_page
+ */
+int sos_map_zero_page(seL4_Word uaddr_unaligned, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word uaddr = PAGE_ALIGN_4K(uaddr_unaligned);
+    int err;
+
+    struct region *region = as_get_region(as, uaddr);
+    if (region == NULL || (region->flags & REGION_ANONYMOUS) == 0 || uaddr >= PROCESS_IPC_BUFFER) {
+        return 1;
+    }
+
+    err = sos_page_table_alloc(as, uaddr);
+    if (err) return err;
+
+    if (zero_frame == 0) {
+        seL4_Word frame_vaddr;
+        err = unswappable_alloc(&frame_vaddr);
+        if (err) return 1;
+
+        /* Note: Allocating may have yielded to someone else doing the same */
+        if (zero_frame == 0) {
+            zero_frame = frame_vaddr;
+        } else {
+            frame_free(frame_vaddr);
+        }
+    }
+
+    struct page_table_entry *pte = &as->page_table[root_index(uaddr)][leaf_index(uaddr)];
+    if (pte->sos_vaddr != 0) return 1;
+
+    seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+            cur_cspace,
+            get_cap(zero_frame),
+            seL4_AllRights);
+    if (copied_cap == CSPACE_NULL) return 1;
+
+    /* The cap has to fit in the entry */
+    if (pte_index(pte_set_index(0, copied_cap)) != copied_cap) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return 1;
+    }
+
+    err = map_page(copied_cap,
+            pcb->vroot,
+            uaddr,
+            region->permissions & (~seL4_CanWrite),
+            seL4_ARM_Default_VMAttributes);
+    if (err) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return ERR_INTERNAL_MAP_ERROR;
+    }
+
+    pte->sos_vaddr = pte_set_index(region->permissions | PTE_VALID | PTE_ZERO, copied_cap);
+
+    return 0;
+}
+
+/*
+ * Map the frame of SOS's own image holding the page at uaddr of a region
+ * loaded from the cpio archive, so the page takes no memory or copying.
+ * Only whole pages of read-only regions that lie page for page in the
+ * archive qualify.
+ * Returns 1 if the page does not qualify and has to be mapped with sos_map_page
+ */
+int sos_map_image_page(seL4_Word uaddr_unaligned, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word uaddr = PAGE_ALIGN_4K(uaddr_unaligned);
+    int err;
+
+    struct region *region = as_get_region(as, uaddr);
+    if (region == NULL || region->image == NULL || (region->permissions & seL4_CanWrite)) return 1;
+    if (uaddr < region->baseaddr || uaddr + PAGE_SIZE_4K > region->baseaddr + region->file_size) return 1;
+
+    seL4_Word image_vaddr = (seL4_Word) region->image + (uaddr - region->baseaddr);
+    if (image_vaddr & PAGE_MASK_4K) return 1;
+
+    err = sos_page_table_alloc(as, uaddr);
+    if (err) return err;
+
+    struct page_table_entry *pte = &as->page_table[root_index(uaddr)][leaf_index(uaddr)];
+    if (pte->sos_vaddr != 0) return 1;
+
+    /* Note: The image frames are handed to us in order from the start of the image */
+    seL4_CPtr image_cap = _boot_info->userImageFrames.start +
+            ((image_vaddr - PAGE_ALIGN_4K((seL4_Word) __executable_start)) >> seL4_PageBits);
+
+    seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+            cur_cspace,
+            image_cap,
+            seL4_AllRights);
+    if (copied_cap == CSPACE_NULL) return 1;
+
+    /* The cap has to fit in the entry */
+    if (pte_index(pte_set_index(0, copied_cap)) != copied_cap) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return 1;
+    }
+
+    err = map_page(copied_cap,
+            pcb->vroot,
+            uaddr,
+            region->permissions,
+            seL4_ARM_Default_VMAttributes);
+    if (err) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return ERR_INTERNAL_MAP_ERROR;
+    }
+
+    /* SOS only ever wrote the archive as data */
+    seL4_ARM_Page_Unify_Instruction(image_cap, 0, PAGE_SIZE_4K);
+
+    pte->sos_vaddr = pte_set_index(region->permissions | PTE_VALID | PTE_IMAGE, copied_cap);
+
+    return 0;
+}
+
+/* Drop the zero or image frame mapping at uaddr, leaving the page untouched again */
+void sos_unmap_zero_page(seL4_Word uaddr, struct app_addrspace *as) {
+    struct page_table_entry *pte = &as->page_table[root_index(uaddr)][leaf_index(uaddr)];
+    seL4_CPtr cap = pte_index(pte->sos_vaddr);
+
+    seL4_ARM_Page_Unmap(cap);
+    cspace_delete_cap(cur_cspace, cap);
+
+    pte->sos_vaddr = 0;
+}
+
+/*
+ * Map the pages following a sequential fault at uaddr in one go
+ *
+ * A fault on the page right after the previous window means every page in
+ * it was used, so the window doubles. Any other fault halves it. Only
+ * untouched and swapped out private pages are brought in and we stop
+ * rather than make the pager or the process's quota evict anything.
+ * Note: Prefetched pages do not count as demand, and untouched anonymous
+ *       pages are left to the zero frame.
+ * Returns -1 if the process went away meanwhile.
+ */
+int sos_fault_around(seL4_Word uaddr, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    pid_t pid = pcb->pid;
+    unsigned int stime = pcb->stime;
+    uaddr = PAGE_ALIGN_4K(uaddr);
+
+    if (uaddr == as->next_fault) {
+        as->fault_window = as->fault_window ? as->fault_window * 2 : 1;
+        if (as->fault_window > FAULT_AROUND_MAX) as->fault_window = FAULT_AROUND_MAX;
+    } else {
+        as->fault_window /= 2;
+    }
+
+    seL4_Word window = as->fault_window;
+    struct region *region = as_get_region(as, uaddr);
+    seL4_Word i;
+
+    for (i = 1; i <= window; i++) {
+        seL4_Word next = uaddr + i * PAGE_SIZE_4K;
+        if (region == NULL || next >= region->baseaddr + region->size || next >= PROCESS_IPC_BUFFER) break;
+        if (frame_available() <= PAGEOUT_HIGH_WATERMARK) break;
+
+        seL4_Word limit = ws_limit(as);
+        if (limit != 0 && as->rss >= limit) break;
+
+        seL4_Word pte = 0;
+        if (as->page_table[root_index(next)] != NULL) {
+            pte = as->page_table[root_index(next)][leaf_index(next)].sos_vaddr;
+        }
+
+        /* Already resident */
+        if (pte != 0 && (pte & PTE_SWAP) == 0) continue;
+
+        /* Sharers and pages still being written out take the slow path */
+        if (pte & (PTE_SHARED | PTE_BEINGSWAPPED)) break;
+
+        /* Read faults on untouched anonymous pages only need the zero frame */
+        if (pte == 0 && (region->flags & REGION_ANONYMOUS)) continue;
+
+        seL4_Word sos_vaddr;
+        int err = sos_map_page_flags(next, &sos_vaddr, pcb, MAP_PREFETCH);
+
+        /* Note: Swapping in yields, the process may be gone */
+        if (!is_still_valid_proc(pid, stime)) return -1;
+        if (err && err != ERR_ALREADY_MAPPED) break;
+    }
+
+    /* Expect the next fault right after the pages we covered */
+    as->next_fault = uaddr + i * PAGE_SIZE_4K;
+
+    return 0;
+}
+
+/*
+ * Handle a write fault on a resident page that was mapped read-only,
+ * either because its frame was clean or because it is copy-on-write.
+ * The frame is marked dirty and remapped with the region's permissions.
+ */
+int sos_dirty_page(seL4_Word uaddr_unaligned, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word uaddr = PAGE_ALIGN_4K(uaddr_unaligned);
+    int err;
+
+    struct region *curr_region = as_get_region(as, uaddr_unaligned);
+
+    /* Genuine write to a read-only region */
+    if (curr_region == NULL || (curr_region->permissions & seL4_CanWrite) == 0) {
+        return ERR_INVALID_REGION;
+    }
+
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    seL4_Word sos_vaddr = as->page_table[index1][index2].sos_vaddr;
+
+    if ((sos_vaddr & PTE_SHARED) && share_is_cow(uaddr, pcb)) {
+        /* Take our own copy, unless we are the last one referencing it */
+        err = share_cow_break(uaddr, pcb, curr_region);
+        if (err < 0) return err;
+        if (err > 0) return 0;
+
+        sos_vaddr = as->page_table[index1][index2].sos_vaddr;
+    }
+
+    /* Shared pages are only writable if every other sharer allows it */
+    if ((sos_vaddr & PTE_SHARED) && !share_can_write(uaddr, pcb)) {
+        return ERR_INVALID_REGION;
+    }
+
+    struct app_cap *app_cap;
+    err = get_app_cap(PAGE_ALIGN_4K(sos_vaddr), as, &app_cap);
+    if (err) return ERR_INTERNAL_MAP_ERROR;
+
+    /* Note: seL4 has no remap for changing rights so unmap and map again */
+    err = seL4_ARM_Page_Unmap(app_cap->cap);
+    if (err) return ERR_INTERNAL_MAP_ERROR;
+
+    seL4_Word map_uaddr = uaddr;
+    if (sos_vaddr & PTE_LARGE) {
+        map_uaddr = PAGE_ALIGN_LARGE(uaddr);
+    }
+
+    err = map_page(app_cap->cap,
+            pcb->vroot,
+            map_uaddr,
+            curr_region->permissions,
+            seL4_ARM_Default_VMAttributes);
+    if (err) return ERR_INTERNAL_MAP_ERROR;
+
+    dirty_frame_entry(sos_vaddr);
+    reference_frame_entry(sos_vaddr);
+
+    return 0;
+}
+
+/*
+ * Map pcb's page at uaddr for SOS to read on its behalf
+ * Note: Unlike sos_map_page, zero and image pages stay shared
+ */
+int sos_map_page_read(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pcb) {
+    return sos_map_page_flags(uaddr_unaligned, sos_vaddr_ret, pcb, MAP_READ);
+}
+
+/*
+ * Map pcb's page at uaddr for SOS to write into on its behalf, as a user
+ * write fault would: copy-on-write pages are copied first, shared pages
+ * must be writable by pcb and the frame is marked dirty.
+ * Returns ERR_INVALID_REGION if pcb could not write the page itself,
+ * before anything is mapped
+ */
+int sos_map_page_write(seL4_Word uaddr_unaligned, seL4_Word *sos_vaddr_ret, struct PCB *pcb) {
+    struct app_addrspace *as = pcb->addrspace;
+    seL4_Word uaddr = PAGE_ALIGN_4K(uaddr_unaligned);
+    int err;
+
+    /* Note: Read-only pages may be frames of the file page cache, shared by every process running the file */
+    struct region *curr_region = as_get_region(as, uaddr_unaligned);
+    if (curr_region == NULL || (curr_region->permissions & seL4_CanWrite) == 0) {
+        return ERR_INVALID_REGION;
+    }
+
+    while (1) {
+        seL4_Word sos_vaddr;
+        err = sos_map_page(uaddr, &sos_vaddr, pcb);
+        if (err && err != ERR_ALREADY_MAPPED) return err;
+
+        sos_vaddr = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+
+        if ((sos_vaddr & PTE_SHARED) && share_is_cow(uaddr, pcb)) {
+            /* Note: The copy may be left for the next fault, so look again */
+            err = share_cow_break(uaddr, pcb, curr_region);
+            if (err < 0) return err;
+            continue;
+        }
+
+        if ((sos_vaddr & PTE_SHARED) && !share_can_write(uaddr, pcb)) {
+            return ERR_INVALID_REGION;
+        }
+
+        dirty_frame_entry(sos_vaddr);
+
+        *sos_vaddr_ret = sos_vaddr;
+        return 0;
+    }
+}
+
 inline seL4_Word uaddr_to_sos_vaddr(seL4_Word uaddr) {
     int index1 = root_index(uaddr);
     int index2 = leaf_index(uaddr);
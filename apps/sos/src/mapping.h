@@ -20,6 +20,11 @@
 #define ERR_INVALID_REGION -3
 #define ERR_NO_MEMORY -4
 #define ERR_INTERNAL_MAP_ERROR -5
+#define ERR_FILE_READ -6
+#define ERR_FILE_WRITE -7
+
+/* Most pages mapped ahead of a sequential fault, 0 disables fault-around */
+#define FAULT_AROUND_MAX 16
 
  /**
  * Maps a page into a page table. 
@@ -49,6 +54,32 @@ int sos_map_page(seL4_Word uaddr, seL4_Word *sos_vaddr_ret, struct PCB *pcb);
 
 int sos_unmap_page(seL4_Word vaddr, struct app_addrspace *as);
 
+int sos_dirty_page(seL4_Word uaddr, struct PCB *pcb);
+
+int sos_map_page_read(seL4_Word uaddr, seL4_Word *sos_vaddr_ret, struct PCB *pcb);
+
+int sos_map_page_write(seL4_Word uaddr, seL4_Word *sos_vaddr_ret, struct PCB *pcb);
+
+int sos_page_writable(seL4_Word uaddr, struct PCB *pcb);
+
+int sos_page_table_alloc(struct app_addrspace *as, seL4_Word uaddr);
+
+void sos_pte_update(struct app_addrspace *as, seL4_Word uaddr, seL4_Word set, seL4_Word clear);
+
+int sos_split_page(seL4_Word uaddr, struct PCB *pcb);
+
+void sos_wait_page(seL4_Word uaddr, struct PCB *pcb);
+
+int sos_write_page(seL4_Word uaddr, seL4_Word sos_vaddr, struct region *region, struct PCB *pcb);
+
+int sos_map_zero_page(seL4_Word uaddr, struct PCB *pcb);
+
+int sos_map_image_page(seL4_Word uaddr, struct PCB *pcb);
+
+void sos_unmap_zero_page(seL4_Word uaddr, struct app_addrspace *as);
+
+int sos_fault_around(seL4_Word uaddr, struct PCB *pcb);
+
 extern inline seL4_Word uaddr_to_sos_vaddr(seL4_Word uaddr);
 
 #endif /* _MAPPING_H_ */
@@ -0,0 +1,104 @@
+#include <string.h>
+#include <utils/page.h>
+
+#include "page_compress.h"
+
+/*
+ * LZ77 page compressor in the style of LZRW1
+ *
+ * Output is groups of up to 8 items, each group led by a control byte with
+ * a bit set for every item that is a match rather than a literal byte.
+ * A match is 2 bytes: the low 8 bits of the offset, then the top 4 bits of
+ * the offset and the length - LZ_MIN_MATCH. Matches may overlap the bytes
+ * they produce, so runs (eg. zero fill) cost 2 bytes per LZ_MAX_MATCH.
+ */
+
+#define LZ_HASH_BITS 10
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_OFFSET 4095
+#define LZ_GROUP_MAX (1 + 8 * 2) /* Largest a group can encode to */
+
+/* Last position each 3 byte prefix was seen at
+ * Note: Stale entries are harmless since every match is checked */
+static uint16_t hash_table[1 << LZ_HASH_BITS];
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t key = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (key * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+int page_compress(const uint8_t *page, uint8_t *buf, uint32_t buf_size) {
+    uint32_t in = 0;
+    uint32_t out = 0;
+
+    memset(hash_table, 0, sizeof(hash_table));
+
+    while (in < PAGE_SIZE_4K) {
+        if (out + LZ_GROUP_MAX > buf_size) return -1;
+
+        uint32_t control_pos = out++;
+        uint8_t control = 0;
+
+        for (int bit = 0; bit < 8 && in < PAGE_SIZE_4K; bit++) {
+            uint32_t len = 0;
+            uint32_t offset = 0;
+
+            if (in + LZ_MIN_MATCH <= PAGE_SIZE_4K) {
+                uint32_t hash = lz_hash(page + in);
+                uint32_t candidate = hash_table[hash];
+                hash_table[hash] = in;
+
+                offset = in - candidate;
+                if (candidate < in && offset <= LZ_MAX_OFFSET) {
+                    uint32_t max = PAGE_SIZE_4K - in;
+                    if (max > LZ_MAX_MATCH) max = LZ_MAX_MATCH;
+                    while (len < max && page[candidate + len] == page[in + len]) len++;
+                }
+            }
+
+            if (len >= LZ_MIN_MATCH) {
+                control |= 1 << bit;
+                buf[out++] = offset & 0xff;
+                buf[out++] = ((offset >> 8) << 4) | (len - LZ_MIN_MATCH);
+                in += len;
+            } else {
+                buf[out++] = page[in++];
+            }
+        }
+
+        buf[control_pos] = control;
+    }
+
+    return out;
+}
+
+int page_decompress(const uint8_t *buf, uint32_t len, uint8_t *page) {
+    uint32_t in = 0;
+    uint32_t out = 0;
+
+    while (in < len && out < PAGE_SIZE_4K) {
+        uint8_t control = buf[in++];
+
+        for (int bit = 0; bit < 8 && in < len && out < PAGE_SIZE_4K; bit++) {
+            if (control & (1 << bit)) {
+                if (in + 2 > len) return -1;
+
+                uint32_t offset = buf[in] | ((buf[in + 1] >> 4) << 8);
+                uint32_t match = (buf[in + 1] & 0xf) + LZ_MIN_MATCH;
+                in += 2;
+
+                if (offset == 0 || offset > out || out + match > PAGE_SIZE_4K) return -1;
+
+                /* Byte by byte since the match may overlap its own output */
+                for (uint32_t i = 0; i < match; i++, out++) {
+                    page[out] = page[out - offset];
+                }
+            } else {
+                page[out++] = buf[in++];
+            }
+        }
+    }
+
+    return (out == PAGE_SIZE_4K) ? 0 : -1;
+}
@@ -0,0 +1,12 @@
+#ifndef _PAGE_COMPRESS_H_
+#define _PAGE_COMPRESS_H_
+
+#include <stdint.h>
+
+/* Compress a 4K page into buf, returns the compressed length or -1 if it does not fit */
+int page_compress(const uint8_t *page, uint8_t *buf, uint32_t buf_size);
+
+/* Expand len bytes from buf back into a 4K page, returns -1 if the data is corrupt */
+int page_decompress(const uint8_t *buf, uint32_t len, uint8_t *page);
+
+#endif
@@ -0,0 +1,93 @@
+#include <cspace/cspace.h>
+#include <clock/clock.h>
+#include <sys/panic.h>
+
+#include "pageout.h"
+#include "frametable.h"
+#include "coroutine.h"
+#include "process.h"
+#include "working_set.h"
+#include "swap_cache.h"
+#include "zswap.h"
+
+#define PAGEOUT_INTERVAL 100000 /* Microseconds */
+
+extern struct PCB *curproc;
+
+static struct PCB *pageout_pcb = NULL;
+
+/* Whether the cleaner is waiting to be woken up */
+static int sleeping = 0;
+static uint32_t timer_id = 0;
+
+static void pageout_daemon(seL4_Word badge, int num_args);
+static void pageout_timer_cb(uint32_t id, void *data);
+
+/*
+ * Start the page cleaner coroutine
+ * Note: Must be called after the syscall loop entry has been set
+ */
+void pageout_start() {
+    int pid = process_new_kernel("pageout", PAGEOUT_PID);
+    conditional_panic(pid == -1, "Could not create pageout task\n");
+
+    pageout_pcb = process_status(PAGEOUT_PID);
+    curproc = pageout_pcb;
+
+    int err = start_coroutine(&pageout_daemon, PAGEOUT_PID, 0, NULL);
+    conditional_panic(err, "Could not start pageout task\n");
+}
+
+/* Kick the cleaner if it is sleeping */
+void pageout_wakeup() {
+    if (!sleeping) return;
+    sleeping = 0;
+
+    if (timer_id != 0) {
+        remove_timer(timer_id);
+        timer_id = 0;
+    }
+
+    set_resume(pageout_pcb->coroutine_id);
+}
+
+static void pageout_timer_cb(uint32_t id, void *data) {
+    if (id != timer_id) return;
+    timer_id = 0;
+
+    if (!sleeping) return;
+    sleeping = 0;
+
+    set_resume(pageout_pcb->coroutine_id);
+}
+
+static void pageout_sleep() {
+    sleeping = 1;
+
+    timer_id = register_timer(PAGEOUT_INTERVAL, &pageout_timer_cb, NULL);
+    if (timer_id == CLOCK_R_UINT) timer_id = 0;
+
+    yield();
+}
+
+/*
+ * Write victims out to the pagefile in the background until the high
+ * watermark of free frames is reached, so faults rarely have to swap
+ */
+static void pageout_daemon(seL4_Word badge, int num_args) {
+    while (1) {
+        /* Note: The cleaner's interval paces the working set samples */
+        ws_sample();
+
+        /* Make room in the compressed pool before it overflows */
+        zswap_writeback();
+
+        while (frame_available() < PAGEOUT_HIGH_WATERMARK) {
+            /* Unused readahead is cheapest to give back */
+            if (swap_cache_shrink() == 0) continue;
+            if (swap_out()) break;
+        }
+
+        pageout_sleep();
+    }
+}
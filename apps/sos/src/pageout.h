@@ -0,0 +1,12 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+/* Free frame watermarks for the page cleaner */
+#define PAGEOUT_LOW_WATERMARK 16
+#define PAGEOUT_HIGH_WATERMARK 48
+
+void pageout_start();
+
+void pageout_wakeup();
+
+#endif /* _PAGEOUT_H_ */
@@ -24,12 +24,13 @@ extern char _cpio_archive[];
 
 struct PCB *curproc;
 
-static struct PCB *PCB_table[MAX_PROCESSES];
+static struct PCB *PCB_table[MAX_PROCESSES + KERNEL_TASKS];
 static int PCB_free_table[MAX_PROCESSES];
 static next_free_pid = 0;
 static last_free_pid = MAX_PROCESSES - 1;
 
 static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_pid, char *elf_base, struct vnode *elf_vnode);
+static int setup_process(char *app_name, seL4_CPtr fault_ep, int parent_pid);
 
 void process_management_init(){
     for (int i = 0; i < MAX_PROCESSES; i++){
@@ -102,9 +103,40 @@ int process_new(char *app_name, seL4_CPtr fault_ep, int parent_pid) {
     return id;
 }
 
-static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_pid, char *elf_base, struct vnode *elf_vnode) {
+/* Create a PCB for a task running inside SOS
+ * Note: These have no addrspace and only exist so the task can run as a coroutine
+ */
+int process_new_kernel(char *name, pid_t pid) {
+    if (pid < MAX_PROCESSES || pid >= MAX_PROCESSES + KERNEL_TASKS) return -1;
+    if (PCB_table[pid] != NULL) return -1;
+
+    struct PCB *proc = malloc(sizeof(struct PCB));
+    if (proc == NULL) return -1;
+    memset(proc, 0, sizeof(struct PCB));
+
+    proc->app_name = malloc(strlen(name) + 1);
+    if (proc->app_name == NULL) {
+        free(proc);
+        return -1;
+    }
+    strcpy(proc->app_name, name);
+
+    proc->addrspace = NULL;
+    proc->stime = time_stamp() / 1000;
+    proc->status = PROCESS_STATUS_NOT_BUSY;
+    proc->pid = pid;
+    proc->wait = PROCESS_WAIT_NONE;
+    proc->coroutine_id = -1;
+    proc->parent = -1;
+
+    PCB_table[pid] = proc;
+
+    return pid;
+}
+
+/* Allocate a pid, PCB, vspace, cspace, IPC buffer and TCB for a new process */
+static int setup_process(char *app_name, seL4_CPtr fault_ep, int parent_pid) {
     int id = -1;
-    unsigned int end_time = UINT_MAX;
 
     /* Max processes reached */
     if (next_free_pid == -1) return -1;
@@ -142,9 +174,6 @@ static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_
     proc->coroutine_id = -1;
     proc->parent = parent_pid;
 
-    /* Required for setting up the TCB */
-    seL4_UserContext context;
-
     /* Create a VSpace */
     proc->vroot_addr = ut_alloc(seL4_PageDirBits);
     if (proc->vroot_addr == NULL) {
@@ -251,6 +280,52 @@ static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_
         return -1;
     }
 
+    return id;
+}
+
+/* Create a copy of parent whose pages are shared copy-on-write */
+int process_fork(struct PCB *parent, seL4_CPtr fault_ep) {
+    int id = setup_process(parent->app_name, fault_ep, parent->pid);
+    if (id == -1) return -1;
+
+    struct PCB *proc = PCB_table[id];
+
+    /* Note: This may yield */
+    int err = as_clone(parent, proc);
+    if (err) {
+        proc->parent = -1;
+        process_destroy(id);
+        return -1;
+    }
+
+    memcpy((void *) proc->ipc_buffer_addr, (void *) parent->ipc_buffer_addr, PAGE_SIZE_4K);
+
+    /* Child resumes from the parent's syscall with 0 as the result */
+    seL4_UserContext context;
+    int num_regs = sizeof(seL4_UserContext) / sizeof(seL4_Word);
+    err = seL4_TCB_ReadRegisters(parent->tcb_cap, 0, 0, num_regs, &context);
+    if (err) {
+        proc->parent = -1;
+        process_destroy(id);
+        return -1;
+    }
+    context.r1 = 0; /* Message info */
+    context.r2 = 0; /* MR0 */
+    seL4_TCB_WriteRegisters(proc->tcb_cap, 1, 0, num_regs, &context);
+
+    return id;
+}
+
+static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_pid, char *elf_base, struct vnode *elf_vnode) {
+    int id = setup_process(app_name, fault_ep, parent_pid);
+    if (id == -1) return -1;
+
+    struct PCB *proc = PCB_table[id];
+    int err;
+
+    /* Required for setting up the TCB */
+    seL4_UserContext context;
+
     /* load the elf image */
     if (elf_vnode == NULL) {
         err = cpio_elf_load(proc->vroot, proc, elf_base);
@@ -285,6 +360,10 @@ static int create_actual_process(char *app_name, seL4_CPtr fault_ep, int parent_
         return -1;
     }
 
+    /* Heap and stack get large frames where they can and read as zero until written */
+    as_set_region_flags(proc->addrspace, PROCESS_HEAP_START, REGION_LARGE_PAGES | REGION_ANONYMOUS);
+    as_set_region_flags(proc->addrspace, PROCESS_STACK_BOT, REGION_LARGE_PAGES | REGION_ANONYMOUS);
+
     /* Start the new process */
     memset(&context, 0, sizeof(context));
     context.pc = elf_getEntryPoint(elf_base);
@@ -352,6 +431,6 @@ int process_destroy(pid_t pid) {
 }
 
 struct PCB *process_status(pid_t pid) {
-    if (pid < 0 || pid >= MAX_PROCESSES) return NULL;
+    if (pid < 0 || pid >= MAX_PROCESSES + KERNEL_TASKS) return NULL;
     return PCB_table[pid];
 }
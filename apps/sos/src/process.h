@@ -14,6 +14,10 @@
 
 #define MAX_PROCESSES 32
 
+/* Pids from MAX_PROCESSES upwards belong to SOS's own tasks */
+#define KERNEL_TASKS 1
+#define PAGEOUT_PID (MAX_PROCESSES)
+
 #define PROCESS_WAIT_NONE -2
 #define PROCESS_WAIT_ANY -1
 
@@ -48,6 +52,8 @@ struct PCB {
 int is_still_valid_proc(pid_t pid, unsigned int stime);
 int process_new_cpio(char* app_name, seL4_CPtr fault_ep, int parent_pid);
 int process_new(char* app_name, seL4_CPtr fault_ep, int parent_pid);
+int process_new_kernel(char *name, pid_t pid);
+int process_fork(struct PCB *parent, seL4_CPtr fault_ep);
 int process_destroy(pid_t pid);
 void process_management_init();
 struct PCB *process_status(pid_t pid);
@@ -0,0 +1,798 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cspace/cspace.h>
+#include <utils/page.h>
+
+#include "share_vm.h"
+#include "frametable.h"
+#include "mapping.h"
+#include "coroutine.h"
+#include "swap_bitmap.h"
+
+extern struct PCB *curproc;
+extern int curr_coroutine_id;
+
+static struct share_member {
+    struct PCB *pcb;
+    int writable;
+    struct share_member *next;
+};
+
+static struct share_waiter {
+    pid_t pid;
+    unsigned int stime;
+    int coroutine_id;
+    struct share_waiter *next;
+};
+
+/*
+ * A page shared at the same address by several processes, either through
+ * sos_share_vm or copy-on-write after a fork
+ *
+ * While resident the frame is in sos_vaddr (0 otherwise) and the
+ * pagefile slot, if any, is in swap_index. busy is set while the page is
+ * moving to or from the pagefile and sharers faulting meanwhile wait on it.
+ * Sharers not mapping the frame keep the share id in their page table
+ * entry, the others find it through the frame.
+ * Read-only pages of a file also remember the vnode and offset they came
+ * from, so other processes running the same file join them on a fault.
+ */
+struct shared_page {
+    uint32_t id;
+    seL4_Word uaddr;
+    seL4_Word sos_vaddr;
+    int32_t swap_index;
+    int busy;
+    int cow;
+    struct share_member *members;
+    struct share_waiter *waiters;
+    struct shared_page *next;
+    struct vnode *vnode;
+    seL4_Word file_offset;
+    struct shared_page *file_next;
+};
+
+/* Pages shared through sos_share_vm, looked up by address when joining */
+static struct shared_page *shared_pages = NULL;
+
+/* Read-only file pages, hashed by vnode and file offset */
+#define FILE_CACHE_BUCKETS 64
+
+static struct shared_page *file_pages[FILE_CACHE_BUCKETS];
+
+/* Share ids index this table, free entries are chained through next_free */
+#define SHARE_TABLE_MIN 64
+#define SHARE_TABLE_MAX (1 << (32 - PTE_INDEX_SHIFT))
+
+static union share_slot {
+    struct shared_page *sp;
+    int32_t next_free;
+} *share_table = NULL;
+
+static uint32_t share_table_size = 0;
+static int32_t share_free_id = -1;
+
+static int32_t share_id_alloc(struct shared_page *sp) {
+    if (share_free_id < 0) {
+        /* Out of ids, double the table */
+        uint32_t new_size = share_table_size ? share_table_size * 2 : SHARE_TABLE_MIN;
+        if (new_size > SHARE_TABLE_MAX) return -1;
+
+        union share_slot *new_table = realloc(share_table, new_size * sizeof(union share_slot));
+        if (new_table == NULL) return -1;
+
+        for (uint32_t i = share_table_size; i < new_size; i++) {
+            new_table[i].next_free = (i + 1 < new_size) ? (int32_t) (i + 1) : -1;
+        }
+        share_free_id = share_table_size;
+        share_table = new_table;
+        share_table_size = new_size;
+    }
+
+    int32_t id = share_free_id;
+    share_free_id = share_table[id].next_free;
+    share_table[id].sp = sp;
+
+    return id;
+}
+
+static void share_id_free(uint32_t id) {
+    share_table[id].next_free = share_free_id;
+    share_free_id = id;
+}
+
+static inline struct shared_page *pte_share(struct app_addrspace *as, seL4_Word uaddr) {
+    seL4_Word pte = as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr;
+
+    /* Note: Entries mapping the frame hold its address instead of the id */
+    if (pte & PTE_SWAP) return share_table[pte_index(pte)].sp;
+    return share_table[get_frame_share(pte)].sp;
+}
+
+static struct shared_page *new_share(seL4_Word uaddr, int cow) {
+    struct shared_page *sp = malloc(sizeof(struct shared_page));
+    if (sp == NULL) return NULL;
+
+    int32_t id = share_id_alloc(sp);
+    if (id < 0) {
+        free(sp);
+        return NULL;
+    }
+
+    sp->id = id;
+    sp->uaddr = uaddr;
+    sp->sos_vaddr = 0;
+    sp->swap_index = -1;
+    sp->busy = 0;
+    sp->cow = cow;
+    sp->members = NULL;
+    sp->waiters = NULL;
+    sp->next = NULL;
+    sp->vnode = NULL;
+    sp->file_offset = 0;
+    sp->file_next = NULL;
+
+    if (!cow) {
+        sp->next = shared_pages;
+        shared_pages = sp;
+    }
+
+    return sp;
+}
+
+static inline uint32_t file_bucket(struct vnode *vnode, seL4_Word file_offset) {
+    return ((((seL4_Word) vnode) >> 4) ^ (file_offset >> seL4_PageBits)) % FILE_CACHE_BUCKETS;
+}
+
+/* Offset in the region's file of the page at uaddr */
+static inline seL4_Word file_page_offset(struct region *region, seL4_Word uaddr) {
+    return region->file_offset + uaddr - region->baseaddr;
+}
+
+static struct shared_page *find_file_share(struct vnode *vnode, seL4_Word file_offset) {
+    struct shared_page *curr = file_pages[file_bucket(vnode, file_offset)];
+    while (curr != NULL && (curr->vnode != vnode || curr->file_offset != file_offset)) {
+        curr = curr->file_next;
+    }
+    return curr;
+}
+
+static int add_member(struct shared_page *sp, struct PCB *pcb, int writable) {
+    struct share_member *member = malloc(sizeof(struct share_member));
+    if (member == NULL) return -1;
+
+    member->pcb = pcb;
+    member->writable = writable;
+    member->next = sp->members;
+    sp->members = member;
+
+    return 0;
+}
+
+static void remove_member(struct shared_page *sp, struct app_addrspace *as) {
+    struct share_member **curr = &sp->members;
+    while (*curr != NULL && (*curr)->pcb->addrspace != as) {
+        curr = &(*curr)->next;
+    }
+    if (*curr == NULL) return;
+
+    struct share_member *to_free = *curr;
+    *curr = to_free->next;
+    free(to_free);
+}
+
+static struct shared_page *find_share(seL4_Word uaddr) {
+    struct shared_page *curr = shared_pages;
+    while (curr != NULL && curr->uaddr != uaddr) {
+        curr = curr->next;
+    }
+    return curr;
+}
+
+static struct share_member *find_member(struct shared_page *sp, struct PCB *pcb) {
+    struct share_member *curr = sp->members;
+    while (curr != NULL && curr->pcb != pcb) {
+        curr = curr->next;
+    }
+    return curr;
+}
+
+/* Resume everyone waiting for the page to finish moving */
+static void share_wakeup(struct shared_page *sp) {
+    struct share_waiter *curr = sp->waiters;
+    while (curr != NULL) {
+        struct share_waiter *to_free = curr;
+        if (is_still_valid_proc(curr->pid, curr->stime)) {
+            set_resume(curr->coroutine_id);
+        }
+        curr = curr->next;
+        free(to_free);
+    }
+    sp->waiters = NULL;
+}
+
+static int share_wait(struct shared_page *sp) {
+    struct share_waiter *waiter = malloc(sizeof(struct share_waiter));
+    if (waiter == NULL) return -1;
+
+    waiter->pid = curproc->pid;
+    waiter->stime = curproc->stime;
+    waiter->coroutine_id = curr_coroutine_id;
+    waiter->next = sp->waiters;
+    sp->waiters = waiter;
+
+    yield();
+
+    return 0;
+}
+
+static void remove_share(struct shared_page *sp) {
+    share_wakeup(sp);
+
+    struct share_member *member = sp->members;
+    while (member != NULL) {
+        struct share_member *to_free = member;
+        member = member->next;
+        free(to_free);
+    }
+
+    if (!sp->cow) {
+        struct shared_page **curr = &shared_pages;
+        while (*curr != sp) {
+            curr = &(*curr)->next;
+        }
+        *curr = sp->next;
+    }
+
+    if (sp->vnode != NULL) {
+        struct shared_page **curr = &file_pages[file_bucket(sp->vnode, sp->file_offset)];
+        while (*curr != sp) {
+            curr = &(*curr)->file_next;
+        }
+        *curr = sp->file_next;
+    }
+
+    share_id_free(sp->id);
+    free(sp);
+}
+
+/* Unmap every sharer so their next access remaps with up to date rights */
+static void share_revoke(struct shared_page *sp) {
+    if (sp->sos_vaddr == 0) return;
+
+    int index1 = root_index(sp->uaddr);
+    int index2 = leaf_index(sp->uaddr);
+
+    struct share_member *member = sp->members;
+    while (member != NULL) {
+        struct app_addrspace *as = member->pcb->addrspace;
+        struct app_cap *app_cap;
+
+        if (get_app_cap(sp->sos_vaddr, as, &app_cap) == 0 &&
+                seL4_ARM_Page_Unmap(app_cap->cap) == 0) {
+            as->page_table[index1][index2].sos_vaddr |= PTE_SOFT;
+        }
+
+        member = member->next;
+    }
+}
+
+/*
+ * Add a page of pcb's addrspace to the share at its address
+ *
+ * The first sharer's page becomes the shared page, later sharers drop
+ * their private copy and map the shared one on their next access.
+ */
+int share_vm_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, int writable) {
+    struct app_addrspace *as = pcb->addrspace;
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    int err;
+
+    seL4_Word pte = 0;
+    if (as->page_table != NULL && as->page_table[index1] != NULL) {
+        pte = as->page_table[index1][index2].sos_vaddr;
+    }
+
+    if (pte & PTE_SHARED) {
+        struct shared_page *curr = pte_share(as, uaddr);
+        if (!curr->cow) {
+            /* Already sharing, only the access changes */
+            struct share_member *member = find_member(curr, pcb);
+            if (member == NULL) return -1;
+
+            member->writable = writable;
+            share_revoke(curr);
+            return 0;
+        }
+
+        /* Copy-on-write after a fork, take our own copy first */
+        err = share_cow_break(uaddr, pcb, region);
+        if (err < 0) return -1;
+        pte = as->page_table[index1][index2].sos_vaddr;
+    }
+
+    struct shared_page *sp = find_share(uaddr);
+    int mapped = 0;
+
+    while ((sp == NULL && !mapped) || pte == 0 || (pte & (PTE_BEINGSWAPPED | PTE_LARGE | PTE_ZERO | PTE_IMAGE))) {
+        if (pte & PTE_LARGE) {
+            /* Only small pages can be shared */
+            err = sos_split_page(uaddr, pcb);
+            if (err) return -1;
+        } else {
+            /* Bring our own page in (creates page tables and waits out swapping) */
+            seL4_Word sos_vaddr;
+            err = sos_map_page(uaddr, &sos_vaddr, pcb);
+            if (err && err != ERR_ALREADY_MAPPED) return -1;
+            mapped = 1;
+        }
+
+        /* Note: Mapping may have yielded */
+        sp = find_share(uaddr);
+        pte = as->page_table[index1][index2].sos_vaddr;
+        if (pte & (PTE_SWAP | PTE_LARGE)) mapped = 0;
+    }
+
+    if (sp == NULL) {
+        /* First sharer, our resident frame becomes the shared page */
+        sp = new_share(uaddr, 0);
+        if (sp == NULL) return -1;
+
+        sp->sos_vaddr = PAGE_ALIGN_4K(pte);
+        set_frame_share(sp->sos_vaddr, sp->id);
+
+        as->page_table[index1][index2].sos_vaddr |= PTE_SHARED;
+    } else {
+        /* Joining, drop our private copy */
+        if (pte & PTE_VALID) {
+            if (pte & PTE_SWAP) {
+                free_swap_index(pte_index(pte));
+            } else {
+                sos_unmap_page(PAGE_ALIGN_4K(pte), as);
+                frame_free(PAGE_ALIGN_4K(pte));
+            }
+        }
+
+        pte = region->permissions | PTE_VALID | PTE_SWAP | PTE_SHARED;
+        as->page_table[index1][index2].sos_vaddr = pte_set_index(pte, sp->id);
+    }
+
+    err = add_member(sp, pcb, writable);
+    if (err) {
+        share_leave(uaddr, as);
+        return -1;
+    }
+
+    /* Other sharers may have lost write access */
+    share_revoke(sp);
+
+    return 0;
+}
+
+/*
+ * Give the child of a fork the parent's page at uaddr
+ *
+ * Private pages become copy-on-write shares between the two, pages
+ * already shared get the child as another sharer. Nothing is copied or
+ * read from the pagefile until someone writes.
+ */
+int share_fork_page(seL4_Word uaddr, struct PCB *parent, struct PCB *child) {
+    struct app_addrspace *parent_as = parent->addrspace;
+    struct app_addrspace *child_as = child->addrspace;
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    int err;
+
+    seL4_Word pte = parent_as->page_table[index1][index2].sos_vaddr;
+
+    /* Note: Pages still on the zero frame or SOS's image are untouched for the child too */
+    if ((pte & PTE_VALID) == 0 || (pte & (PTE_ZERO | PTE_IMAGE))) return 0;
+
+    if (pte & PTE_LARGE) {
+        /* Only small pages can be shared */
+        err = sos_split_page(uaddr, parent);
+        if (err) return -1;
+
+        pte = parent_as->page_table[index1][index2].sos_vaddr;
+    }
+
+    err = sos_page_table_alloc(child_as, uaddr);
+    if (err) return -1;
+
+    if (pte & PTE_BEINGSWAPPED) {
+        /* Wait for the page to settle */
+        seL4_Word sos_vaddr;
+        err = sos_map_page(uaddr, &sos_vaddr, parent);
+        if (err && err != ERR_ALREADY_MAPPED) return -1;
+
+        pte = parent_as->page_table[index1][index2].sos_vaddr;
+    }
+
+    struct shared_page *sp;
+    int writable = 0;
+
+    if (pte & PTE_SHARED) {
+        sp = pte_share(parent_as, uaddr);
+
+        struct share_member *member = find_member(sp, parent);
+        if (member != NULL) writable = member->writable;
+    } else {
+        /* Private page becomes copy-on-write */
+        sp = new_share(uaddr, 1);
+        if (sp == NULL) return -1;
+
+        err = add_member(sp, parent, 0);
+        if (err) {
+            remove_share(sp);
+            return -1;
+        }
+
+        if (pte & PTE_SWAP) {
+            /* Slot moves to the share */
+            sp->swap_index = pte_index(pte);
+            pte = pte_set_index(pte, sp->id);
+        } else {
+            sp->sos_vaddr = PAGE_ALIGN_4K(pte);
+            set_frame_share(sp->sos_vaddr, sp->id);
+        }
+
+        pte |= PTE_SHARED;
+        parent_as->page_table[index1][index2].sos_vaddr = pte;
+    }
+
+    err = add_member(sp, child, writable);
+    if (err) return -1;
+
+    /* Child maps the page on its first access */
+    pte &= (PAGE_MASK_4K & ~(PTE_SOFT | PTE_BEINGSWAPPED));
+    child_as->page_table[index1][index2].sos_vaddr = pte_set_index(pte, sp->id) | PTE_SWAP;
+
+    /* Parent loses write access to copy-on-write pages */
+    share_revoke(sp);
+
+    return 0;
+}
+
+/* Map the shared page at uaddr into pcb, bringing it in from the pagefile if needed */
+int share_map_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, seL4_Word *sos_vaddr_ret) {
+    struct app_addrspace *as = pcb->addrspace;
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    int err;
+
+    struct shared_page *sp;
+    while ((sp = pte_share(as, uaddr))->busy) {
+        if (share_wait(sp)) return ERR_NO_MEMORY;
+    }
+
+    if (sp->sos_vaddr == 0) {
+        /* First sharer to touch it since it was swapped out */
+        seL4_Word frame_vaddr;
+        sp->busy = 1;
+
+        if (sp->swap_index >= 0) {
+            err = frame_alloc_flags(&frame_vaddr, FRAME_ALLOC_NOZERO);
+        } else {
+            err = frame_alloc(&frame_vaddr);
+        }
+        if (!err && sp->swap_index >= 0) {
+            err = swap_in_slot(frame_vaddr, sp->swap_index);
+            if (err) {
+                frame_free(frame_vaddr);
+            } else {
+                /* Slot is now kept by the frame until it is written to */
+                sp->swap_index = -1;
+            }
+        }
+
+        sp->busy = 0;
+        if (err) {
+            share_wakeup(sp);
+            return ERR_NO_MEMORY;
+        }
+
+        sp->sos_vaddr = frame_vaddr;
+        set_frame_share(frame_vaddr, sp->id);
+        share_wakeup(sp);
+
+        /* Everyone left while we were busy */
+        if (sp->members == NULL) {
+            frame_free(frame_vaddr);
+            remove_share(sp);
+            return ERR_INVALID_REGION;
+        }
+    }
+
+    seL4_Word frame_vaddr = sp->sos_vaddr;
+
+    seL4_CapRights rights = region->permissions;
+    if (!is_frame_dirty(frame_vaddr) || !share_can_write(uaddr, pcb)) {
+        rights &= (~seL4_CanWrite);
+    }
+
+    seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+            cur_cspace,
+            get_cap(frame_vaddr),
+            seL4_AllRights);
+
+    err = map_page(copied_cap,
+            pcb->vroot,
+            uaddr,
+            rights,
+            seL4_ARM_Default_VMAttributes);
+    if (err) {
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return ERR_INTERNAL_MAP_ERROR;
+    }
+
+    err = insert_app_cap(frame_vaddr, copied_cap, pcb, uaddr);
+    if (err) {
+        seL4_ARM_Page_Unmap(copied_cap);
+        cspace_delete_cap(cur_cspace, copied_cap);
+        return ERR_NO_MEMORY;
+    }
+
+    seL4_Word mask = as->page_table[index1][index2].sos_vaddr & PAGE_MASK_4K;
+    mask &= ~(PTE_SWAP | PTE_SOFT | PTE_BEINGSWAPPED);
+    as->page_table[index1][index2].sos_vaddr = frame_vaddr | mask;
+
+    reference_frame_entry(frame_vaddr);
+    as->page_count += 1;
+
+    *sos_vaddr_ret = frame_vaddr;
+    return 0;
+}
+
+/*
+ * Map the page at uaddr of a read-only file-backed region from another
+ * process running the same file, instead of reading it again
+ * Returns 1 if nobody has the page, it then has to be read in and handed
+ * to share_file_add
+ */
+int share_file_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, seL4_Word *sos_vaddr_ret) {
+    struct app_addrspace *as = pcb->addrspace;
+
+    /* Cached frames are only ever handed to read-only regions, nobody may write them */
+    if (region->permissions & seL4_CanWrite) return 1;
+
+    struct shared_page *sp = find_file_share(region->vnode, file_page_offset(region, uaddr));
+
+    /* Note: A share with no members is on its way out, its vnode may have been reused */
+    if (sp == NULL || sp->members == NULL || sp->uaddr != uaddr) return 1;
+
+    int err = add_member(sp, pcb, 0);
+    if (err) return ERR_NO_MEMORY;
+
+    seL4_Word pte = region->permissions | PTE_VALID | PTE_SWAP | PTE_SHARED;
+    as->page_table[root_index(uaddr)][leaf_index(uaddr)].sos_vaddr = pte_set_index(pte, sp->id);
+
+    return share_map_page(uaddr, pcb, region, sos_vaddr_ret);
+}
+
+/*
+ * Offer the page at uaddr, just read in from its region's file, to other
+ * processes running the same file
+ * Note: The page is shared copy-on-write so a private mapping of the file never sees it
+ */
+void share_file_add(seL4_Word uaddr, struct PCB *pcb, struct region *region) {
+    struct app_addrspace *as = pcb->addrspace;
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    seL4_Word file_offset = file_page_offset(region, uaddr);
+
+    if (region->permissions & seL4_CanWrite) return;
+
+    /* Someone else read it in at the same time */
+    if (find_file_share(region->vnode, file_offset) != NULL) return;
+
+    seL4_Word pte = as->page_table[index1][index2].sos_vaddr;
+    if ((pte & PTE_VALID) == 0 || (pte & (PTE_SWAP | PTE_SHARED | PTE_LARGE | PTE_ZERO | PTE_IMAGE))) return;
+
+    struct shared_page *sp = new_share(uaddr, 1);
+    if (sp == NULL) return;
+
+    if (add_member(sp, pcb, 0)) {
+        remove_share(sp);
+        return;
+    }
+
+    sp->sos_vaddr = PAGE_ALIGN_4K(pte);
+    set_frame_share(sp->sos_vaddr, sp->id);
+    as->page_table[index1][index2].sos_vaddr |= PTE_SHARED;
+
+    uint32_t bucket = file_bucket(region->vnode, file_offset);
+    sp->vnode = region->vnode;
+    sp->file_offset = file_offset;
+    sp->file_next = file_pages[bucket];
+    file_pages[bucket] = sp;
+}
+
+/* A sharer may write if and only if all other sharers made the page writable */
+int share_can_write(seL4_Word uaddr, struct PCB *pcb) {
+    struct shared_page *sp = pte_share(pcb->addrspace, PAGE_ALIGN_4K(uaddr));
+
+    /* Copy-on-write pages have to be copied first */
+    if (sp->cow) return 0;
+
+    struct share_member *member = sp->members;
+    while (member != NULL) {
+        if (member->pcb != pcb && !member->writable) return 0;
+        member = member->next;
+    }
+
+    return 1;
+}
+
+int share_is_cow(seL4_Word uaddr, struct PCB *pcb) {
+    return pte_share(pcb->addrspace, PAGE_ALIGN_4K(uaddr))->cow;
+}
+
+/*
+ * Give pcb its own copy of a copy-on-write page
+ *
+ * Returns 1 if the page was dealt with (copied and mapped writable, or
+ * left for the next fault), 0 if pcb was the last sharer and the page
+ * simply became private again, and a negative mapping error otherwise.
+ */
+int share_cow_break(seL4_Word uaddr, struct PCB *pcb, struct region *region) {
+    struct app_addrspace *as = pcb->addrspace;
+    int index1 = root_index(uaddr);
+    int index2 = leaf_index(uaddr);
+    seL4_Word frame_vaddr;
+    struct shared_page *sp;
+    int err;
+
+    while (1) {
+        sp = pte_share(as, uaddr);
+        if (sp->busy) {
+            if (share_wait(sp)) return ERR_NO_MEMORY;
+            continue;
+        }
+
+        seL4_Word pte = as->page_table[index1][index2].sos_vaddr & (~PTE_SHARED);
+
+        if (sp->members->next == NULL) {
+            /* Last one left, the page is private again */
+            if (sp->sos_vaddr == 0) {
+                as->page_table[index1][index2].sos_vaddr = pte_set_index(pte, sp->swap_index);
+                remove_share(sp);
+                return 1;
+            }
+
+            set_frame_share(sp->sos_vaddr, -1);
+
+            if (pte & PTE_SWAP) {
+                /* Resident but never mapped by us, pick it up on the next fault */
+                pte &= (PAGE_MASK_4K & ~PTE_SWAP);
+                as->page_table[index1][index2].sos_vaddr = sp->sos_vaddr | pte | PTE_SOFT;
+                remove_share(sp);
+                return 1;
+            }
+
+            as->page_table[index1][index2].sos_vaddr = pte;
+            remove_share(sp);
+            return 0;
+        }
+
+        if (sp->sos_vaddr == 0) {
+            /* Bring the shared page in so it can be copied */
+            err = share_map_page(uaddr, pcb, region, &frame_vaddr);
+            if (err) return err;
+            continue;
+        }
+
+        /* Note: The copy overwrites the whole frame */
+        err = frame_alloc_flags(&frame_vaddr, FRAME_ALLOC_NOZERO);
+        if (err) return ERR_NO_MEMORY;
+
+        /* Note: Allocating may have yielded and moved the shared page */
+        if (sp->busy || sp->sos_vaddr == 0 || sp->members->next == NULL) {
+            frame_free(frame_vaddr);
+            continue;
+        }
+
+        break;
+    }
+
+    memcpy((void *) frame_vaddr, (void *) sp->sos_vaddr, PAGE_SIZE_4K);
+    seL4_ARM_Page_Unify_Instruction(get_cap(frame_vaddr), 0, PAGE_SIZE_4K);
+
+    /* Swap our mapping of the shared frame for the copy */
+    seL4_Word pte = as->page_table[index1][index2].sos_vaddr;
+    if ((pte & PTE_SWAP) == 0) {
+        sos_unmap_page(sp->sos_vaddr, as);
+    }
+
+    seL4_CPtr copied_cap = cspace_copy_cap(cur_cspace,
+            cur_cspace,
+            get_cap(frame_vaddr),
+            seL4_AllRights);
+
+    err = map_page(copied_cap,
+            pcb->vroot,
+            uaddr,
+            region->permissions,
+            seL4_ARM_Default_VMAttributes);
+    if (!err) {
+        err = insert_app_cap(frame_vaddr, copied_cap, pcb, uaddr);
+        if (err) seL4_ARM_Page_Unmap(copied_cap);
+    }
+    if (err) {
+        /* Still a sharer, the shared frame gets mapped again on the next fault */
+        cspace_delete_cap(cur_cspace, copied_cap);
+        frame_free(frame_vaddr);
+        as->page_table[index1][index2].sos_vaddr = pte_set_index(pte & (~PTE_SOFT), sp->id) | PTE_SWAP;
+        return ERR_INTERNAL_MAP_ERROR;
+    }
+
+    remove_member(sp, as);
+
+    if (pte & PTE_SWAP) as->page_count += 1;
+
+    pte &= (PAGE_MASK_4K & ~(PTE_SHARED | PTE_SWAP | PTE_SOFT | PTE_BEINGSWAPPED));
+    as->page_table[index1][index2].sos_vaddr = frame_vaddr | pte;
+
+    return 1;
+}
+
+/*
+ * Remove an addrspace from the share at uaddr, the last one out frees the page
+ * Note: The leaving addrspace must already be unmapped from the frame
+ */
+void share_leave(seL4_Word uaddr, struct app_addrspace *as) {
+    struct shared_page *sp = pte_share(as, uaddr);
+
+    remove_member(sp, as);
+
+    if (sp->members != NULL) return;
+
+    /* Whoever is moving the page cleans up once done */
+    if (sp->busy) return;
+
+    if (sp->sos_vaddr != 0) {
+        frame_free(sp->sos_vaddr);
+    } else if (sp->swap_index >= 0) {
+        free_swap_index(sp->swap_index);
+    }
+
+    remove_share(sp);
+}
+
+/* The shared frame is being evicted, uaddr and as are those of any sharer */
+struct shared_page *share_swap_begin(seL4_Word uaddr, struct app_addrspace *as) {
+    struct shared_page *sp = pte_share(as, uaddr);
+
+    sp->busy = 1;
+    sp->sos_vaddr = 0;
+
+    return sp;
+}
+
+/* The shared frame has been evicted, its contents are in swap_index */
+void share_swap_end(struct shared_page *sp, int32_t swap_index) {
+    sp->busy = 0;
+    sp->sos_vaddr = 0;
+    sp->swap_index = swap_index;
+    share_wakeup(sp);
+
+    if (sp->members == NULL) {
+        free_swap_index(swap_index);
+        remove_share(sp);
+    }
+}
+
+/* Writing the shared frame out failed so it stays resident
+ * Returns non zero if the share is gone and the frame should be freed */
+int share_swap_abort(struct shared_page *sp, seL4_Word sos_vaddr) {
+    sp->busy = 0;
+    sp->sos_vaddr = sos_vaddr;
+    share_wakeup(sp);
+
+    if (sp->members == NULL) {
+        remove_share(sp);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _SHARE_VM_H_
+#define _SHARE_VM_H_
+
+#include <cspace/cspace.h>
+
+#include "addrspace.h"
+#include "process.h"
+
+struct shared_page;
+
+int share_vm_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, int writable);
+
+int share_fork_page(seL4_Word uaddr, struct PCB *parent, struct PCB *child);
+
+int share_map_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, seL4_Word *sos_vaddr_ret);
+
+int share_file_page(seL4_Word uaddr, struct PCB *pcb, struct region *region, seL4_Word *sos_vaddr_ret);
+
+void share_file_add(seL4_Word uaddr, struct PCB *pcb, struct region *region);
+
+int share_can_write(seL4_Word uaddr, struct PCB *pcb);
+
+int share_is_cow(seL4_Word uaddr, struct PCB *pcb);
+
+int share_cow_break(seL4_Word uaddr, struct PCB *pcb, struct region *region);
+
+void share_leave(seL4_Word uaddr, struct app_addrspace *as);
+
+struct shared_page *share_swap_begin(seL4_Word uaddr, struct app_addrspace *as);
+
+void share_swap_end(struct shared_page *sp, int32_t swap_index);
+
+int share_swap_abort(struct shared_page *sp, seL4_Word sos_vaddr);
+
+#endif /* _SHARE_VM_H_ */
@@ -12,6 +12,9 @@
 #include "vmem_layout.h"
 #include "process.h"
 #include "vnode.h"
+#include "frametable.h"
+#include "share_vm.h"
+#include "working_set.h"
 
 extern struct PCB *curproc;
 extern struct oft_entry of_table[MAX_OPEN_FILE];
@@ -20,7 +23,7 @@ extern seL4_Word curr_free_ofd;
 extern seL4_CPtr _sos_ipc_ep_cap;
 extern seL4_Word curr_coroutine_id;
 
-static char *sys_name[14] = {
+static char *sys_name[21] = {
     "Sos write",
     "Sos read",
     "Sos open",
@@ -34,7 +37,14 @@ static char *sys_name[14] = {
     "Sos process delete",
     "Sos process id",
     "Sos process wait",
-    "Sos process status"
+    "Sos process status",
+    "Sos share vm",
+    "Sos process fork",
+    "Sos mem limit",
+    "Sos vm stats",
+    "Sos mmap",
+    "Sos munmap",
+    "Sos msync"
 };
 
 void handle_syscall(seL4_Word badge, int num_args) {
@@ -105,6 +115,34 @@ void handle_syscall(seL4_Word badge, int num_args) {
             syscall_process_status(reply_cap);
             break;
 
+        case SOS_SHARE_VM_SYSCALL:
+            syscall_share_vm(reply_cap);
+            break;
+
+        case SOS_PROCESS_FORK_SYSCALL:
+            syscall_process_fork(reply_cap, badge);
+            break;
+
+        case SOS_MEM_LIMIT_SYSCALL:
+            syscall_mem_limit(reply_cap);
+            break;
+
+        case SOS_VM_STATS_SYSCALL:
+            syscall_vm_stats(reply_cap);
+            break;
+
+        case SOS_MMAP_SYSCALL:
+            syscall_mmap(reply_cap);
+            break;
+
+        case SOS_MUNMAP_SYSCALL:
+            syscall_munmap(reply_cap);
+            break;
+
+        case SOS_MSYNC_SYSCALL:
+            syscall_msync(reply_cap);
+            break;
+
         default:
             /* we don't want to reply to an unknown syscall */
 
@@ -116,13 +154,9 @@ void handle_syscall(seL4_Word badge, int num_args) {
 /* Checks that user pointer range is a valid in userspace */
 static int legal_uaddr(seL4_Word base, uint32_t size) {
     /* Check valid region */
-    struct region *curr = curproc->addrspace->regions;
-    while (curr != NULL) {
-        if (base >= curr->baseaddr &&
-                base + size < curr->baseaddr + curr->size) {
-            break;
-        }
-        curr = curr->next;
+    struct region *curr = as_get_region(curproc->addrspace, base);
+    if (curr != NULL && base + size >= curr->baseaddr + curr->size) {
+        curr = NULL;
     }
 
     /* User pointers should be below IPC buffer */
@@ -203,7 +237,8 @@ static int validate_max_ofd(seL4_CPtr reply_cap, int ofd_count) {
 }
 
 static int validate_pid(seL4_CPtr reply_cap, pid_t pid) {
-    if (process_status(pid) == NULL) {
+    /* Note: SOS's own tasks are not visible to applications */
+    if (pid >= MAX_PROCESSES || process_status(pid) == NULL) {
         send_err(reply_cap, -1);
         return -1;
     }
@@ -229,7 +264,7 @@ static int get_safe_path(char *dst, seL4_Word uaddr,
         if (len == safe_len) {
             /* Make sure address is mapped */
             seL4_Word sos_vaddr_next;
-            int err = sos_map_page(uaddr_next_page, &sos_vaddr_next, curproc);
+            int err = sos_map_page_read(uaddr_next_page, &sos_vaddr_next, curproc);
             if (err && err != ERR_ALREADY_MAPPED) return -1;
 
             sos_vaddr_next = PAGE_ALIGN_4K(sos_vaddr_next);
@@ -276,8 +311,17 @@ void syscall_brk(seL4_CPtr reply_cap) {
         return;
     }
 
-    /* Set new heap region */
-    curr_region->size = newbrk - PROCESS_HEAP_START;
+    /* Set new heap region, giving back the pages past a lowered break */
+    seL4_Word size = newbrk - PROCESS_HEAP_START;
+    if (size < curr_region->size) {
+        int err = as_trim_region(curproc, curr_region, size);
+        if (err) {
+            send_err(reply_cap, -1);
+            return;
+        }
+    } else {
+        curr_region->size = size;
+    }
 
     /* Reply */
     seL4_SetMR(0, 0);
@@ -377,7 +421,7 @@ void syscall_stat(seL4_CPtr reply_cap) {
     char path_sos_vaddr[MAX_PATH_LEN];
     /* Make sure path address is mapped */
     seL4_Word sos_vaddr;
-    int err = sos_map_page(uaddr, &sos_vaddr, curproc);
+    int err = sos_map_page_read(uaddr, &sos_vaddr, curproc);
     if (err && err != ERR_ALREADY_MAPPED) {
         send_err(reply_cap, -1);
         return;
@@ -532,7 +576,7 @@ void syscall_open(seL4_CPtr reply_cap) {
     char path_sos_vaddr[MAX_PATH_LEN];
     /* Make sure address is mapped */
     seL4_Word sos_vaddr;
-    int err = sos_map_page(uaddr, &sos_vaddr, curproc);
+    int err = sos_map_page_read(uaddr, &sos_vaddr, curproc);
     if (err && err != ERR_ALREADY_MAPPED) {
         send_err(reply_cap, -1);
         return;
@@ -632,7 +676,7 @@ void syscall_process_create(seL4_CPtr reply_cap, seL4_Word badge) {
     char path_sos_vaddr[MAX_PATH_LEN];
     /* Make sure address is mapped */
     seL4_Word sos_vaddr;
-    int err = sos_map_page(path_uaddr, &sos_vaddr, curproc);
+    int err = sos_map_page_read(path_uaddr, &sos_vaddr, curproc);
     if (err && err != ERR_ALREADY_MAPPED) {
         send_err(reply_cap, -1);
         return;
@@ -750,8 +794,8 @@ void syscall_process_status(seL4_CPtr reply_cap) {
         strcpy(buffer.command, pcb->app_name);
 
         seL4_Word sos_vaddr;
-        int err = sos_map_page(&uaddr[procs], &sos_vaddr, curproc);
-        if (err && err != ERR_ALREADY_MAPPED) {
+        int err = sos_map_page_write(&uaddr[procs], &sos_vaddr, curproc);
+        if (err) {
             unpin_frame_entry(uaddr, size);
             send_err(reply_cap, procs);
             return;
@@ -764,8 +808,8 @@ void syscall_process_status(seL4_CPtr reply_cap) {
 
         if (PAGE_ALIGN_4K(cast_uaddr + sizeof(sos_process_t)) != PAGE_ALIGN_4K(cast_uaddr)) {
             seL4_Word sos_vaddr_next;
-            int err = sos_map_page(PAGE_ALIGN_4K(cast_uaddr + sizeof(sos_process_t)), &sos_vaddr_next, curproc);
-            if (err && err != ERR_ALREADY_MAPPED) {
+            int err = sos_map_page_write(PAGE_ALIGN_4K(cast_uaddr + sizeof(sos_process_t)), &sos_vaddr_next, curproc);
+            if (err) {
                 unpin_frame_entry(uaddr, size);
                 send_err(reply_cap, procs);
                 return;
@@ -787,3 +831,244 @@ void syscall_process_status(seL4_CPtr reply_cap) {
     seL4_SetMR(0, procs);
     send_reply(reply_cap);
 }
+
+void syscall_share_vm(seL4_CPtr reply_cap) {
+    seL4_Word uaddr = seL4_GetMR(1);
+    size_t size = seL4_GetMR(2);
+    int writable = seL4_GetMR(3);
+
+    /* Both address and size must be page aligned */
+    if (size == 0 || (uaddr & PAGE_MASK_4K) || (size & PAGE_MASK_4K)) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    if (validate_uaddr(reply_cap, uaddr, size - 1)) return;
+
+    struct region *region = get_region(uaddr);
+    if (region == NULL) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    for (seL4_Word page = uaddr; page < uaddr + size; page += PAGE_SIZE_4K) {
+        int err = share_vm_page(page, curproc, region, writable);
+        if (err) {
+            send_err(reply_cap, -1);
+            return;
+        }
+    }
+
+    seL4_SetMR(0, 0);
+    send_reply(reply_cap);
+}
+
+void syscall_process_fork(seL4_CPtr reply_cap, seL4_Word badge) {
+    curproc->status = PROCESS_STATUS_BUSY;
+
+    int new_pid = process_fork(curproc, _sos_ipc_ep_cap);
+
+    if (curproc->status == PROCESS_STATUS_BUSY) {
+        curproc->status = PROCESS_STATUS_NOT_BUSY;
+    }
+
+    /* new_pid is -1 on error, the child gets 0 */
+    seL4_SetMR(0, new_pid);
+    send_reply(reply_cap);
+}
+
+void syscall_mem_limit(seL4_CPtr reply_cap) {
+    pid_t pid = seL4_GetMR(1);
+    seL4_Word frames = seL4_GetMR(2);
+
+    if (pid == -1) {
+        /* Global frame budget */
+        frame_set_limit(frames);
+    } else {
+        if (validate_pid(reply_cap, pid)) return;
+
+        /* Only a process itself or its parent may limit it, and never below the working set floor */
+        struct PCB *pcb = process_status(pid);
+        if ((pid != curproc->pid && pcb->parent != curproc->pid) ||
+                (frames != 0 && frames < WS_MIN_FRAMES)) {
+            send_err(reply_cap, -1);
+            return;
+        }
+
+        /* Note: Frames over a lowered limit go as the process faults or as memory runs short */
+        pcb->addrspace->rss_limit = frames;
+    }
+
+    seL4_SetMR(0, 0);
+    send_reply(reply_cap);
+}
+
+void syscall_vm_stats(seL4_CPtr reply_cap) {
+    sos_vm_stats_t stats;
+    frame_vm_stats(&stats);
+
+    /* Counters go back one per register */
+    int words = sizeof(sos_vm_stats_t) / sizeof(seL4_Word);
+    seL4_Word *counters = (seL4_Word *) &stats;
+    for (int i = 0; i < words; i++) {
+        seL4_SetMR(i, counters[i]);
+    }
+
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, words);
+    seL4_Send(reply_cap, reply);
+    cspace_free_slot(cur_cspace, reply_cap);
+}
+
+/* Write the dirty pages of a written back region between uaddr and end to its file */
+static int sync_region(struct region *region, seL4_Word uaddr, seL4_Word end) {
+    if ((region->flags & REGION_WRITEBACK) == 0) return 0;
+
+    for (seL4_Word page = PAGE_ALIGN_4K(uaddr); page < end; page += PAGE_SIZE_4K) {
+        int err = frame_sync_page(page, curproc, region);
+        if (err) return -1;
+    }
+
+    return 0;
+}
+
+void syscall_mmap(seL4_CPtr reply_cap) {
+    int fd = seL4_GetMR(1);
+    seL4_Word offset = seL4_GetMR(2);
+    seL4_Word len = seL4_GetMR(3);
+    int prot = seL4_GetMR(4);
+    struct app_addrspace *as = curproc->addrspace;
+    int err;
+
+    /* The file offset must be page aligned and the mapping readable */
+    if (len == 0 || (offset & PAGE_MASK_4K) || (prot & FM_READ) == 0 || (prot & FM_EXEC)) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    /* Anonymous mappings (fd -1) have no file */
+    struct vnode *vnode = NULL;
+    if (fd != -1) {
+        if (validate_fd(reply_cap, fd)) return;
+        int ofd = as->fd_table[fd].ofd;
+        if (validate_ofd(reply_cap, ofd)) return;
+        if (validate_ofd_mode(reply_cap, ofd, FM_READ)) return;
+        if ((prot & FM_WRITE) && validate_ofd_mode(reply_cap, ofd, FM_WRITE)) return;
+
+        /* Only files have pages to map, not devices */
+        vnode = of_table[ofd].vnode;
+        if (vnode->fh == NULL) {
+            send_err(reply_cap, -1);
+            return;
+        }
+    }
+
+    seL4_Word size = PAGE_ALIGN_4K(len + PAGE_SIZE_4K - 1);
+    seL4_Word base = as_find_free(as, PROCESS_MMAP_START, PROCESS_MMAP_END, size);
+    if (base == 0) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    seL4_Word permissions = seL4_CanRead;
+    seL4_Word flags = REGION_MMAP;
+    int mode = FM_READ;
+    if (vnode == NULL) {
+        flags |= REGION_ANONYMOUS;
+    }
+    if (prot & FM_WRITE) {
+        permissions |= seL4_CanWrite;
+        if (vnode != NULL) {
+            flags |= REGION_WRITEBACK;
+            mode |= FM_WRITE;
+        }
+    }
+
+    /* The region keeps its own reference, the file may be closed while mapped */
+    struct vnode *region_vnode = NULL;
+    if (vnode != NULL) {
+        err = vfs_open(vnode->path, mode, &region_vnode);
+        if (err) {
+            send_err(reply_cap, -1);
+            return;
+        }
+    }
+
+    err = as_define_region(as, base, size, permissions);
+    if (err) {
+        if (region_vnode != NULL) vfs_close(region_vnode, mode);
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    /* Note: Pages are read in or zeroed as they are touched */
+    as_set_region_flags(as, base, flags);
+    if (region_vnode != NULL) {
+        as_set_region_file(as, base, region_vnode, offset, len);
+    }
+
+    seL4_SetMR(0, base);
+    send_reply(reply_cap);
+}
+
+void syscall_munmap(seL4_CPtr reply_cap) {
+    seL4_Word uaddr = seL4_GetMR(1);
+    seL4_Word len = seL4_GetMR(2);
+
+    /* Any page aligned range inside a single mapping made by sos_mmap can go */
+    seL4_Word end = uaddr + PAGE_ALIGN_4K(len + PAGE_SIZE_4K - 1);
+    struct region *region = get_region(uaddr);
+    if (region == NULL || (region->flags & REGION_MMAP) == 0 || (uaddr & PAGE_MASK_4K) ||
+            len == 0 || end <= uaddr || end > region->baseaddr + region->size) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    int err = sync_region(region, uaddr, end);
+    if (err) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    /* The rest of the mapping after the range stays as a region of its own */
+    if (end < region->baseaddr + region->size) {
+        err = as_split_region(curproc, region, end);
+        if (err) {
+            send_err(reply_cap, -1);
+            return;
+        }
+    }
+
+    if (uaddr == region->baseaddr) {
+        err = as_remove_region(curproc, region);
+    } else {
+        err = as_trim_region(curproc, region, uaddr - region->baseaddr);
+    }
+    if (err) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    seL4_SetMR(0, 0);
+    send_reply(reply_cap);
+}
+
+void syscall_msync(seL4_CPtr reply_cap) {
+    seL4_Word uaddr = seL4_GetMR(1);
+    seL4_Word len = seL4_GetMR(2);
+
+    struct region *region = get_region(uaddr);
+    if (region == NULL || (region->flags & REGION_MMAP) == 0 ||
+            uaddr + len < uaddr || uaddr + len > region->baseaddr + region->size) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    int err = sync_region(region, uaddr, uaddr + len);
+    if (err) {
+        send_err(reply_cap, -1);
+        return;
+    }
+
+    seL4_SetMR(0, 0);
+    send_reply(reply_cap);
+}
@@ -15,6 +15,13 @@
 #define SOS_PROCESS_ID_SYSCALL 11
 #define SOS_PROCESS_WAIT_SYSCALL 12
 #define SOS_PROCESS_STATUS_SYSCALL 13
+#define SOS_SHARE_VM_SYSCALL 14
+#define SOS_PROCESS_FORK_SYSCALL 15
+#define SOS_MEM_LIMIT_SYSCALL 16
+#define SOS_VM_STATS_SYSCALL 17
+#define SOS_MMAP_SYSCALL 18
+#define SOS_MUNMAP_SYSCALL 19
+#define SOS_MSYNC_SYSCALL 20
 
 #include <cspace/cspace.h>
 
@@ -48,4 +55,17 @@ void syscall_process_wait(seL4_CPtr reply_cap, seL4_Word badge);
 
 void syscall_process_status(seL4_CPtr reply_cap);
 
+void syscall_share_vm(seL4_CPtr reply_cap);
+
+void syscall_process_fork(seL4_CPtr reply_cap, seL4_Word badge);
+
+void syscall_mem_limit(seL4_CPtr reply_cap);
+void syscall_vm_stats(seL4_CPtr reply_cap);
+
+void syscall_mmap(seL4_CPtr reply_cap);
+
+void syscall_munmap(seL4_CPtr reply_cap);
+
+void syscall_msync(seL4_CPtr reply_cap);
+
 #endif
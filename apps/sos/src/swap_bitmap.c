@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/panic.h>
+#include <utils/page.h>
+
+#include "swap_bitmap.h"
+#include "swap_cache.h"
+#include "zswap.h"
+
+/*
+ * Pagefile sectors are tracked in two level bitmaps kept in memory, so
+ * allocating never needs I/O.
+ *
+ * used_map has a bit per sector, set while allocated, and end_map marks
+ * the last sector of every allocated run so its length can be recovered.
+ * free_summary has a bit per used_map word, set while that word has a
+ * free sector, which lets the search skip full stretches 1024 sectors at
+ * a time. Runs are placed first fit so the pagefile stays compact and
+ * neighbouring pages written together stay together.
+ */
+
+#define BITS 32
+#define MAP_WORDS_MIN 128
+
+static uint32_t *used_map = NULL;
+static uint32_t *end_map = NULL;
+static uint32_t *free_summary = NULL;
+static uint32_t map_words = 0; /* Words of used_map and end_map */
+
+/* End of the used part of the pagefile */
+static uint32_t end_index = 0;
+
+static inline int bit_test(uint32_t *map, uint32_t bit) {
+    return (map[bit / BITS] >> (bit % BITS)) & 1;
+}
+
+/* Keep the summary bit of a used_map word up to date */
+static inline void update_summary(uint32_t word) {
+    if (used_map[word] == ~0u) {
+        free_summary[word / BITS] &= ~(1u << (word % BITS));
+    } else {
+        free_summary[word / BITS] |= (1u << (word % BITS));
+    }
+}
+
+/* Make room in the maps for sectors up to end */
+static int maps_grow(uint32_t end) {
+    uint32_t words = (end + BITS - 1) / BITS;
+    if (words <= map_words) return 0;
+
+    uint32_t capacity = map_words ? map_words : MAP_WORDS_MIN;
+    while (capacity < words) capacity *= 2;
+
+    uint32_t summary_words = (map_words + BITS - 1) / BITS;
+    uint32_t summary_capacity = (capacity + BITS - 1) / BITS;
+
+    uint32_t *used = realloc(used_map, capacity * sizeof(uint32_t));
+    if (used == NULL) return -1;
+    used_map = used;
+
+    uint32_t *ends = realloc(end_map, capacity * sizeof(uint32_t));
+    if (ends == NULL) return -1;
+    end_map = ends;
+
+    uint32_t *summary = realloc(free_summary, summary_capacity * sizeof(uint32_t));
+    if (summary == NULL) return -1;
+    free_summary = summary;
+
+    memset(used_map + map_words, 0, (capacity - map_words) * sizeof(uint32_t));
+    memset(end_map + map_words, 0, (capacity - map_words) * sizeof(uint32_t));
+    memset(free_summary + summary_words, 0, (summary_capacity - summary_words) * sizeof(uint32_t));
+
+    uint32_t first = map_words;
+    map_words = capacity;
+    for (uint32_t word = first; word < map_words; word++) update_summary(word);
+
+    return 0;
+}
+
+static void mark_run(uint32_t start, uint32_t sectors, int used) {
+    for (uint32_t sector = start; sector < start + sectors; sector++) {
+        if (used) {
+            used_map[sector / BITS] |= (1u << (sector % BITS));
+        } else {
+            used_map[sector / BITS] &= ~(1u << (sector % BITS));
+        }
+    }
+
+    for (uint32_t word = start / BITS; word <= (start + sectors - 1) / BITS; word++) {
+        update_summary(word);
+    }
+
+    uint32_t last = start + sectors - 1;
+    if (used) {
+        end_map[last / BITS] |= (1u << (last % BITS));
+    } else {
+        end_map[last / BITS] &= ~(1u << (last % BITS));
+    }
+}
+
+/* First free stretch of sectors below the end of the pagefile, -1 if there is none */
+static int find_run(uint32_t sectors) {
+    uint32_t run = 0;
+    uint32_t start = 0;
+    uint32_t words = (end_index + BITS - 1) / BITS;
+
+    uint32_t word = 0;
+    while (word < words) {
+        if (run == 0 && (free_summary[word / BITS] >> (word % BITS) & 1) == 0) {
+            /* Word is full, skip the whole summary word if that is full too */
+            if (free_summary[word / BITS] == 0) {
+                word = (word / BITS + 1) * BITS;
+            } else {
+                word++;
+            }
+            continue;
+        }
+
+        for (uint32_t bit = 0; bit < BITS; bit++) {
+            uint32_t sector = word * BITS + bit;
+            if (sector >= end_index) return -1;
+
+            if (used_map[word] & (1u << bit)) {
+                run = 0;
+            } else {
+                if (run == 0) start = sector;
+                if (++run == sectors) return start;
+            }
+        }
+        word++;
+    }
+
+    return -1;
+}
+
+/* Find room for a stretch of sectors, extending the pagefile if there is no hole for it */
+static int alloc_sectors(uint32_t sectors) {
+    int start = find_run(sectors);
+    if (start >= 0) return start;
+
+    if (end_index + sectors > SWAP_MAX_SECTORS) return -1;
+    if (maps_grow(end_index + sectors)) return -1;
+
+    start = end_index;
+    end_index += sectors;
+    return start;
+}
+
+int get_swap_index(uint32_t sectors) {
+    if (sectors == 0 || sectors > SWAP_PAGE_SECTORS) return -1;
+
+    int index = alloc_sectors(sectors);
+    if (index < 0) return -1;
+
+    mark_run(index, sectors, 1);
+    return index;
+}
+
+/* Allocate count runs back to back so they can be written in one go */
+int get_swap_run(uint32_t *sectors, uint32_t count, int32_t *indices) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (sectors[i] == 0 || sectors[i] > SWAP_PAGE_SECTORS) return -1;
+        total += sectors[i];
+    }
+
+    int index = alloc_sectors(total);
+    if (index < 0) return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        indices[i] = index;
+        mark_run(index, sectors[i], 1);
+        index += sectors[i];
+    }
+
+    return 0;
+}
+
+int free_swap_index(uint32_t index) {
+    uint32_t sectors = swap_index_sectors(index);
+    if (sectors == 0) return -1;
+
+    /* A copy read ahead is of no use once the slot can be reused */
+    swap_cache_drop(index);
+
+    /* Note: A page being written back from the compressed pool keeps the slot until that is done */
+    if (zswap_drop(index)) return 0;
+
+    mark_run(index, sectors, 0);
+    return 0;
+}
+
+/* Length of the run starting at index, 0 if no allocated run starts there */
+uint32_t swap_index_sectors(uint32_t index) {
+    if (index >= end_index || !bit_test(used_map, index)) return 0;
+
+    /* The sector before has to be free or end a run of its own */
+    if (index > 0 && bit_test(used_map, index - 1) && !bit_test(end_map, index - 1)) return 0;
+
+    for (uint32_t sectors = 1; sectors <= SWAP_PAGE_SECTORS && index + sectors <= end_index; sectors++) {
+        if (bit_test(end_map, index + sectors - 1)) return sectors;
+    }
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _SWAP_BITMAP_H_
+#define _SWAP_BITMAP_H_
+
+#include <cspace/cspace.h>
+
+/* The pagefile is allocated in sectors, a page takes a run of 1 up to
+ * SWAP_PAGE_SECTORS of them depending on how well it compressed.
+ * A swap index is the first sector of its run */
+#define SWAP_SECTOR_SIZE 512
+#define SWAP_PAGE_SECTORS (PAGE_SIZE_4K / SWAP_SECTOR_SIZE)
+
+/* Indices have to fit in the 20 bits above a page table entry's flags
+ * Note: This caps the pagefile at 512MB (2^20 sectors of 512 bytes),
+ *       allocations past it fail as if the pagefile were full */
+#define SWAP_MAX_SECTORS (1 << 20)
+
+int get_swap_index(uint32_t sectors);
+
+int get_swap_run(uint32_t *sectors, uint32_t count, int32_t *indices);
+
+int free_swap_index(uint32_t index);
+
+uint32_t swap_index_sectors(uint32_t index);
+
+#endif
@@ -0,0 +1,131 @@
+#include <string.h>
+#include <cspace/cspace.h>
+#include <utils/page.h>
+
+#include "swap_cache.h"
+#include "frametable.h"
+
+/*
+ * Swap cache of pages read ahead from the pagefile
+ *
+ * A page is kept in a frame of its own, keyed by the slot its page table
+ * entry still refers to, until its fault takes the frame over. Entries leave in
+ * the order they came in when the cache is full or memory is short.
+ * The readahead window doubles on every hit and halves whenever a page
+ * leaves the cache unused.
+ */
+
+static struct swap_cache_entry {
+    int32_t swap_index;
+    seL4_Word frame_vaddr; /* 0 if the entry is unused */
+    uint32_t age;
+};
+
+static struct swap_cache_entry cache[SWAP_CACHE_SIZE];
+static uint32_t cache_count = 0;
+static uint32_t cache_clock = 0; /* Age of the next insert */
+
+static uint32_t window = 1;
+
+/* Tuning counters */
+static uint32_t readahead_pages = 0;
+static uint32_t readahead_hits = 0;
+static uint32_t readahead_wasted = 0;
+
+static int cache_find(uint32_t swap_index) {
+    if (cache_count == 0) return -1;
+
+    for (int i = 0; i < SWAP_CACHE_SIZE; i++) {
+        if (cache[i].swap_index == (int32_t) swap_index && cache[i].frame_vaddr != 0) return i;
+    }
+    return -1;
+}
+
+/* Take the entry out, its frame is someone else's now */
+static void cache_forget(int i) {
+    cache[i].swap_index = -1;
+    cache[i].frame_vaddr = 0;
+    cache_count--;
+}
+
+static void cache_remove(int i) {
+    frame_free(cache[i].frame_vaddr);
+    cache_forget(i);
+}
+
+/* Drop the oldest page, it was read for nothing so read less from now on */
+static int cache_evict_oldest() {
+    int oldest = -1;
+    for (int i = 0; i < SWAP_CACHE_SIZE; i++) {
+        if (cache[i].frame_vaddr == 0) continue;
+        if (oldest == -1 || cache_clock - cache[i].age > cache_clock - cache[oldest].age) {
+            oldest = i;
+        }
+    }
+    if (oldest == -1) return -1;
+
+    cache_remove(oldest);
+    readahead_wasted++;
+    if (window > 1) window /= 2;
+
+    return 0;
+}
+
+/* Keep a frame holding the page in swap_index until its fault, the cache now owns the frame */
+int swap_cache_insert(uint32_t swap_index, seL4_Word frame_vaddr) {
+    if (cache_find(swap_index) >= 0) return -1;
+    if (cache_count == SWAP_CACHE_SIZE) cache_evict_oldest();
+
+    for (int i = 0; i < SWAP_CACHE_SIZE; i++) {
+        if (cache[i].frame_vaddr != 0) continue;
+
+        cache[i].swap_index = swap_index;
+        cache[i].frame_vaddr = frame_vaddr;
+        cache[i].age = cache_clock++;
+        cache_count++;
+        readahead_pages++;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Hand over the frame holding the page in swap_index if it was read ahead, 0 if not */
+seL4_Word swap_cache_take(uint32_t swap_index) {
+    int i = cache_find(swap_index);
+    if (i < 0) return 0;
+
+    seL4_Word frame_vaddr = cache[i].frame_vaddr;
+    cache_forget(i);
+
+    readahead_hits++;
+    if (window < SWAP_READAHEAD_MAX) window *= 2;
+
+    return frame_vaddr;
+}
+
+int swap_cache_contains(uint32_t swap_index) {
+    return cache_find(swap_index) >= 0;
+}
+
+/* The slot was freed, its page will never be faulted in */
+void swap_cache_drop(uint32_t swap_index) {
+    int i = cache_find(swap_index);
+    if (i >= 0) cache_remove(i);
+}
+
+/* Give a frame back under memory pressure, returns -1 if the cache is empty */
+int swap_cache_shrink() {
+    return cache_evict_oldest();
+}
+
+uint32_t swap_cache_window() {
+    return window;
+}
+
+void swap_cache_stats(sos_vm_stats_t *stats) {
+    stats->readahead_pages = readahead_pages;
+    stats->readahead_hits = readahead_hits;
+    stats->readahead_wasted = readahead_wasted;
+    stats->readahead_window = window;
+}
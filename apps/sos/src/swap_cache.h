@@ -0,0 +1,22 @@
+#ifndef _SWAP_CACHE_H_
+#define _SWAP_CACHE_H_
+
+#include <cspace/cspace.h>
+#include <sos.h>
+
+/* Frames held for pages read ahead of their faults */
+#define SWAP_CACHE_SIZE 64
+
+/* Pages read ahead of a fault at most */
+#define SWAP_READAHEAD_MAX 8
+
+int swap_cache_insert(uint32_t swap_index, seL4_Word frame_vaddr);
+seL4_Word swap_cache_take(uint32_t swap_index);
+int swap_cache_contains(uint32_t swap_index);
+void swap_cache_drop(uint32_t swap_index);
+int swap_cache_shrink();
+
+uint32_t swap_cache_window();
+void swap_cache_stats(sos_vm_stats_t *stats);
+
+#endif /* _SWAP_CACHE_H_ */
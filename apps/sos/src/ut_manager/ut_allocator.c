@@ -341,6 +341,54 @@ static void do_ut_free_from_list(seL4_Word addr, int sizebits){
 
 
 
+/*************************
+ *** large object pool ***
+ ************************/
+
+/* Objects larger than a primary slab take a run of aligned primary slabs */
+static seL4_Word do_ut_alloc_from_slabs(int sizebits){
+    seL4_Word align;
+    int units;
+    int offset;
+    int i;
+
+    units = 1 << (sizebits - PRIMARY_POOL_SIZEBITS);
+    align = (1 << sizebits) - 1;
+
+    /* Start at the first slab with an aligned physical address */
+    offset = (((_pool_base + align) & ~align) - _pool_base) >> PRIMARY_POOL_SIZEBITS;
+
+    for(; offset + units <= PRIMARY_POOL->size; offset += units){
+        for(i = 0; i < units; i++){
+            if(bf_get(PRIMARY_POOL, offset + i)){
+                break;
+            }
+        }
+        if(i == units){
+            for(i = 0; i < units; i++){
+                bf_set(PRIMARY_POOL, offset + i);
+            }
+            return (offset << PRIMARY_POOL_SIZEBITS) + _pool_base;
+        }
+    }
+
+    return 0;
+}
+
+static void do_ut_free_to_slabs(seL4_Word addr, int sizebits){
+    int units;
+    int offset;
+    int i;
+
+    units = 1 << (sizebits - PRIMARY_POOL_SIZEBITS);
+    offset = (addr - _pool_base) >> PRIMARY_POOL_SIZEBITS;
+    for(i = 0; i < units; i++){
+        bf_clr(PRIMARY_POOL, offset + i);
+    }
+}
+
+
+
 /**************************
  *** Exported functions ***
  **************************/
@@ -392,6 +440,10 @@ seL4_Word ut_alloc(int sizebits){
     case 14:
         addr = do_ut_alloc_from_bitfield(sizebits);
         break;
+    case 16:
+    case 20:
+        addr = do_ut_alloc_from_slabs(sizebits);
+        break;
     default:
         assert(!"ut_free received invalid size");
         return 0;
@@ -415,6 +467,10 @@ void ut_free(seL4_Word addr, int sizebits){
     case 14:
         do_ut_free_from_bitfield(addr, sizebits);
         break;
+    case 16:
+    case 20:
+        do_ut_free_to_slabs(addr, sizebits);
+        break;
     default:
         assert(!"ut_free received invalid size");
     }
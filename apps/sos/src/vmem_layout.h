@@ -28,6 +28,8 @@
  * processes it loads up */
 #define PROCESS_HEAP_START  (0x20000000)
 #define PROCESS_HEAP_END    (0x60000000)
+#define PROCESS_MMAP_START  (0x60000000)
+#define PROCESS_MMAP_END    (0x70000000)
 #define PROCESS_STACK_BOT   (0x70000000)
 #define PROCESS_STACK_TOP   (0x90000000)
 #define PROCESS_IPC_BUFFER  (0xA0000000)
@@ -8,6 +8,7 @@
 #include "process.h"
 #include "coroutine.h"
 #include "mapping.h"
+#include "frametable.h"
 
 #include <sys/panic.h>
 #include <sys/stat.h>
@@ -15,6 +16,7 @@
 #define VNODE_TABLE_SLOTS 64
 #define NUM_ARG 4
 #define MAX_WRITE_SIZE 1024
+#define MAX_WRITE_BURST 16 /* Writes in flight at once, each has a bit in the mask */
 
 /* Externs */
 extern struct PCB *curproc;
@@ -343,8 +345,8 @@ static void vnode_readdir_cb(uintptr_t token_ptr, enum nfs_stat status, int num_
 
         seL4_Word sos_vaddr;
 
-        int err = sos_map_page(uaddr, &sos_vaddr, pcb);
-        if (err && err != ERR_ALREADY_MAPPED) {
+        int err = sos_map_page_write(uaddr, &sos_vaddr, pcb);
+        if (err) {
             set_routine_arg(coroutine_id, 2, -1);
             return;
         }
@@ -355,8 +357,8 @@ static void vnode_readdir_cb(uintptr_t token_ptr, enum nfs_stat status, int num_
             seL4_Word uaddr_next = PAGE_ALIGN_4K(uaddr) + PAGE_SIZE_4K;
 
             seL4_Word sos_vaddr_next;
-            err = sos_map_page(uaddr_next, &sos_vaddr_next, pcb);
-            if (err && err != ERR_ALREADY_MAPPED) {
+            err = sos_map_page_write(uaddr_next, &sos_vaddr_next, pcb);
+            if (err) {
                 set_routine_arg(coroutine_id, 2, -1);
                 return;
             }
@@ -412,8 +414,8 @@ static int vnode_stat(struct vnode *vnode, sos_stat_t *stat) {
     if (status == NFS_OK) {
         seL4_Word sos_vaddr;
         seL4_Word uaddr = (seL4_Word) stat;
-        err = sos_map_page(uaddr, &sos_vaddr, curproc);
-        if (err && err != ERR_ALREADY_MAPPED) {
+        err = sos_map_page_write(uaddr, &sos_vaddr, curproc);
+        if (err) {
             free(fattr);
             return -1;
         }
@@ -442,8 +444,8 @@ static int vnode_stat(struct vnode *vnode, sos_stat_t *stat) {
 
         if (PAGE_ALIGN_4K(uaddr + sizeof(stat)) != PAGE_ALIGN_4K(uaddr)) {
             seL4_Word sos_vaddr_next;
-            err = sos_map_page(PAGE_ALIGN_4K(uaddr + sizeof(stat)), &sos_vaddr_next, curproc);
-            if (err && err != ERR_ALREADY_MAPPED) {
+            err = sos_map_page_write(PAGE_ALIGN_4K(uaddr + sizeof(stat)), &sos_vaddr_next, curproc);
+            if (err) {
                 free(buffer);
                 free(fattr);
                 return -1;
@@ -750,16 +752,17 @@ static int vnode_read(struct vnode *vnode, struct uio *uio) {
         /* Set sos_vaddr */
         if (uio->uaddr != NULL) {
             /* uaddr */
-            err = sos_map_page((seL4_Word) uaddr, &sos_vaddr, proc);
-            if (err && err != ERR_ALREADY_MAPPED) {
+            /* Data is read straight into the frame, bypassing the user's mapping */
+            err = sos_map_page_write((seL4_Word) uaddr, &sos_vaddr, proc);
+            if (err) {
                 return -1;
             }
 
             sos_vaddr = PAGE_ALIGN_4K(sos_vaddr);
             sos_vaddr |= ((seL4_Word) uaddr & PAGE_MASK_4K);
         } else {
-            /* vaddr */
-            sos_vaddr = uio->vaddr;
+            /* vaddr, carrying on after a short read */
+            sos_vaddr = uio->vaddr + (uio->size - buf_size);
         }
 
         seL4_Word *token = malloc(sizeof(seL4_Word) * 3);
@@ -845,7 +848,7 @@ static int vnode_write(struct vnode *vnode, struct uio *uio) {
     if (uio->uaddr != NULL) {
         /* uaddr */
         uaddr = uio->uaddr;
-        err = sos_map_page((seL4_Word) uaddr, &sos_vaddr, curproc);
+        err = sos_map_page_read((seL4_Word) uaddr, &sos_vaddr, curproc);
         if (err && err != ERR_ALREADY_MAPPED) return -1;
     } else {
         /* vaddr */
@@ -875,12 +878,16 @@ static int vnode_write(struct vnode *vnode, struct uio *uio) {
             /* Update uaddr's sos_vaddr */
             sos_vaddr_next = uaddr_to_sos_vaddr(uaddr_next);
             if (uaddr_next < end_uaddr) {
-                err = sos_map_page((seL4_Word) uaddr_next, &sos_vaddr_next, curproc);
+                err = sos_map_page_read((seL4_Word) uaddr_next, &sos_vaddr_next, curproc);
                 if (err && err != ERR_ALREADY_MAPPED) return -1;
             }
         } else {
-            /* vaddr */
+            /* vaddr, a burst at a time */
+            sos_vaddr = uio->vaddr + (uio->size - buf_size);
             size = buf_size;
+            if (size > MAX_WRITE_SIZE * MAX_WRITE_BURST) {
+                size = MAX_WRITE_SIZE * MAX_WRITE_BURST;
+            }
         }
 
         int req_id = 0;
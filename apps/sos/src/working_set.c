@@ -0,0 +1,67 @@
+#include <cspace/cspace.h>
+#include <clock/clock.h>
+
+#include "working_set.h"
+#include "frametable.h"
+#include "pageout.h"
+#include "process.h"
+
+static timestamp_t last_sample = 0;
+
+/*
+ * Page fault frequency working set manager
+ *
+ * Every WS_SAMPLE_INTERVAL each process's rate of pages brought in is
+ * measured. Processes faulting above WS_PFF_HIGH get a bigger working set
+ * target, ones below WS_PFF_LOW have theirs cut back. While memory is short
+ * a process at its target replaces its own pages, and frames of processes
+ * over their target are the first taken by everyone else. This keeps one
+ * thrashing process from evicting everyone else's working set.
+ */
+void ws_sample() {
+    timestamp_t now = time_stamp();
+    if (now - last_sample < WS_SAMPLE_INTERVAL) return;
+
+    timestamp_t elapsed = now - last_sample;
+    last_sample = now;
+
+    for (pid_t pid = 0; pid < MAX_PROCESSES; pid++) {
+        struct PCB *pcb = process_status(pid);
+        if (pcb == NULL || pcb->addrspace == NULL) continue;
+
+        struct app_addrspace *as = pcb->addrspace;
+        seL4_Word faults = as->page_ins - as->ws_page_ins;
+        as->ws_page_ins = as->page_ins;
+
+        uint64_t rate = (uint64_t) faults * 1000000 / elapsed;
+
+        if (as->ws_target == 0) {
+            /* First look at this process, start from what it has */
+            as->ws_target = (as->rss > WS_MIN_FRAMES) ? as->rss : WS_MIN_FRAMES;
+        }
+
+        if (rate > WS_PFF_HIGH) {
+            /* Faulting too much, let it grow */
+            if (as->ws_target < as->rss) as->ws_target = as->rss;
+            as->ws_target += WS_GROW;
+        } else if (rate < WS_PFF_LOW) {
+            /* Idle, its pages are the first to go */
+            as->ws_target -= (as->ws_target >> WS_SHRINK_SHIFT);
+            if (as->ws_target < WS_MIN_FRAMES) as->ws_target = WS_MIN_FRAMES;
+        }
+    }
+}
+
+/*
+ * Frames as may keep before it has to replace its own pages, 0 for no limit
+ * Note: The working set target only applies while memory is short
+ */
+seL4_Word ws_limit(struct app_addrspace *as) {
+    seL4_Word limit = as->rss_limit;
+
+    if (as->ws_target != 0 && frame_available() < PAGEOUT_HIGH_WATERMARK) {
+        if (limit == 0 || as->ws_target < limit) limit = as->ws_target;
+    }
+
+    return limit;
+}
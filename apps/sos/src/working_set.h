@@ -0,0 +1,21 @@
+#ifndef _WORKING_SET_H_
+#define _WORKING_SET_H_
+
+#include <cspace/cspace.h>
+
+#include "addrspace.h"
+
+/* Page fault frequency thresholds, in pages brought in per second */
+#define WS_PFF_HIGH 64
+#define WS_PFF_LOW 4
+
+#define WS_SAMPLE_INTERVAL 100000 /* Microseconds */
+#define WS_GROW 16 /* Frames a process faulting above WS_PFF_HIGH gains per sample */
+#define WS_SHRINK_SHIFT 2 /* An idle process loses 1/4 of its target per sample */
+#define WS_MIN_FRAMES 8
+
+void ws_sample();
+
+seL4_Word ws_limit(struct app_addrspace *as);
+
+#endif /* _WORKING_SET_H_ */
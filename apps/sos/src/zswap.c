@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <cspace/cspace.h>
+#include <utils/page.h>
+#include <sys/panic.h>
+
+#include "zswap.h"
+#include "frametable.h"
+#include "pageout.h"
+#include "vnode.h"
+
+/*
+ * Compressed first tier in front of the pagefile
+ *
+ * Evicted pages that compress well are kept in a pool of frames owned by
+ * SOS, in 512 byte chunks, under the pagefile slot they were given. The
+ * slot is reserved but nothing is written to it until the pool fills up,
+ * then the page cleaner writes the oldest pages back in LRU order. Pages
+ * that did go out with the rest of their burst are kept as clean copies
+ * and are dropped first when room is needed.
+ *
+ * A fault on a page in the pool takes it out of the pool. If the pool had
+ * the only copy the slot is released and the frame starts out dirty.
+ */
+
+#define ZSWAP_CHUNKS (ZSWAP_POOL_FRAMES * PAGE_SIZE_4K / SWAP_SECTOR_SIZE)
+#define ZSWAP_ENTRIES ZSWAP_CHUNKS
+#define ZSWAP_HASH_SIZE 64
+
+/* Write back once this many chunks hold pages not in the pagefile, down to the low mark */
+#define ZSWAP_WRITEBACK_HIGH (ZSWAP_CHUNKS * 3 / 4)
+#define ZSWAP_WRITEBACK_LOW (ZSWAP_CHUNKS / 2)
+
+#define NO_ENTRY -1
+
+/* Entry flags */
+#define ZSWAP_USED (1 << 0)
+#define ZSWAP_CLEAN (1 << 1) /* Also in the pagefile */
+#define ZSWAP_WRITEBACK (1 << 2) /* Being written back */
+#define ZSWAP_FREED (1 << 3) /* Slot was freed during the write back */
+
+extern struct vnode *swap_vnode;
+
+static struct zswap_entry {
+    int32_t swap_index;
+    uint32_t flags;
+    uint32_t sectors;
+    int16_t first_chunk; /* Data chunks chained through chunk_next */
+    int16_t hash_next;
+    int16_t lru_prev; /* Towards newer entries */
+    int16_t lru_next; /* Towards older entries */
+};
+
+static struct zswap_entry entries[ZSWAP_ENTRIES];
+static int16_t hash_heads[ZSWAP_HASH_SIZE];
+static int16_t lru_newest = NO_ENTRY;
+static int16_t lru_oldest = NO_ENTRY;
+
+static seL4_Word pool_frames[ZSWAP_POOL_FRAMES];
+static int16_t chunk_next[ZSWAP_CHUNKS];
+static int16_t free_chunk = NO_ENTRY;
+static uint32_t free_chunks = 0;
+static uint32_t dirty_chunks = 0;
+
+static int initialised = 0;
+
+/* Tuning counters */
+static uint32_t stored_pages = 0;
+static uint32_t loaded_pages = 0;
+static uint32_t written_back = 0;
+static uint32_t pool_pages = 0;
+
+/* Reserve the pool, the tier is left off if memory can not be spared */
+void zswap_init() {
+    for (int i = 0; i < ZSWAP_POOL_FRAMES; i++) {
+        int err = unswappable_alloc(&pool_frames[i]);
+        if (err) {
+            while (i-- > 0) frame_free(pool_frames[i]);
+            return;
+        }
+    }
+
+    for (int chunk = ZSWAP_CHUNKS - 1; chunk >= 0; chunk--) {
+        chunk_next[chunk] = free_chunk;
+        free_chunk = chunk;
+    }
+    free_chunks = ZSWAP_CHUNKS;
+
+    for (int i = 0; i < ZSWAP_HASH_SIZE; i++) hash_heads[i] = NO_ENTRY;
+
+    initialised = 1;
+}
+
+static inline uint8_t *chunk_addr(int16_t chunk) {
+    int per_frame = PAGE_SIZE_4K / SWAP_SECTOR_SIZE;
+    return (uint8_t *) pool_frames[chunk / per_frame] + (chunk % per_frame) * SWAP_SECTOR_SIZE;
+}
+
+static int16_t entry_find(uint32_t swap_index) {
+    if (!initialised) return NO_ENTRY;
+
+    int16_t i = hash_heads[swap_index % ZSWAP_HASH_SIZE];
+    while (i != NO_ENTRY && entries[i].swap_index != (int32_t) swap_index) {
+        i = entries[i].hash_next;
+    }
+    return i;
+}
+
+static void lru_unlink(int16_t i) {
+    if (entries[i].lru_prev != NO_ENTRY) {
+        entries[entries[i].lru_prev].lru_next = entries[i].lru_next;
+    } else {
+        lru_newest = entries[i].lru_next;
+    }
+    if (entries[i].lru_next != NO_ENTRY) {
+        entries[entries[i].lru_next].lru_prev = entries[i].lru_prev;
+    } else {
+        lru_oldest = entries[i].lru_prev;
+    }
+}
+
+static void chunks_free(int16_t i) {
+    if (entries[i].first_chunk == NO_ENTRY) return;
+    if ((entries[i].flags & ZSWAP_CLEAN) == 0) dirty_chunks -= entries[i].sectors;
+
+    int16_t chunk = entries[i].first_chunk;
+    while (chunk != NO_ENTRY) {
+        int16_t next = chunk_next[chunk];
+        chunk_next[chunk] = free_chunk;
+        free_chunk = chunk;
+        free_chunks++;
+        chunk = next;
+    }
+    entries[i].first_chunk = NO_ENTRY;
+}
+
+/* Forget an entry, its slot stays with whoever holds it */
+static void entry_remove(int16_t i) {
+    chunks_free(i);
+    lru_unlink(i);
+
+    int16_t *link = &hash_heads[entries[i].swap_index % ZSWAP_HASH_SIZE];
+    while (*link != i) link = &entries[*link].hash_next;
+    *link = entries[i].hash_next;
+
+    entries[i].flags = 0;
+    pool_pages--;
+}
+
+/* Drop the oldest page that is also in the pagefile, -1 if there is none */
+static int drop_oldest_clean() {
+    for (int16_t i = lru_oldest; i != NO_ENTRY; i = entries[i].lru_prev) {
+        if ((entries[i].flags & ZSWAP_CLEAN) && (entries[i].flags & ZSWAP_WRITEBACK) == 0) {
+            entry_remove(i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Keep a packed page for swap_index in the pool, returns -1 if it has to go to the pagefile */
+int zswap_store(uint32_t swap_index, uint8_t *data, uint32_t sectors) {
+    if (!initialised || sectors > ZSWAP_MAX_SECTORS) return -1;
+    if (entry_find(swap_index) != NO_ENTRY) return -1;
+
+    /* Make room from pages that are safe in the pagefile */
+    while (free_chunks < sectors) {
+        if (drop_oldest_clean()) return -1;
+    }
+
+    int16_t i;
+    for (i = 0; i < ZSWAP_ENTRIES; i++) {
+        if ((entries[i].flags & ZSWAP_USED) == 0) break;
+    }
+    if (i == ZSWAP_ENTRIES) return -1;
+
+    entries[i].swap_index = swap_index;
+    entries[i].flags = ZSWAP_USED;
+    entries[i].sectors = sectors;
+    entries[i].first_chunk = NO_ENTRY;
+
+    /* Copy the data in, last chunk first so the chain ends up in order */
+    for (int s = sectors - 1; s >= 0; s--) {
+        int16_t chunk = free_chunk;
+        free_chunk = chunk_next[chunk];
+        free_chunks--;
+
+        memcpy(chunk_addr(chunk), data + s * SWAP_SECTOR_SIZE, SWAP_SECTOR_SIZE);
+        chunk_next[chunk] = entries[i].first_chunk;
+        entries[i].first_chunk = chunk;
+    }
+    dirty_chunks += sectors;
+
+    entries[i].hash_next = hash_heads[swap_index % ZSWAP_HASH_SIZE];
+    hash_heads[swap_index % ZSWAP_HASH_SIZE] = i;
+
+    entries[i].lru_prev = NO_ENTRY;
+    entries[i].lru_next = lru_newest;
+    if (lru_newest != NO_ENTRY) entries[lru_newest].lru_prev = i;
+    lru_newest = i;
+    if (lru_oldest == NO_ENTRY) lru_oldest = i;
+
+    stored_pages++;
+    pool_pages++;
+
+    if (dirty_chunks > ZSWAP_WRITEBACK_HIGH) pageout_wakeup();
+
+    return 0;
+}
+
+/* The page was also written to its slot */
+void zswap_mark_clean(uint32_t swap_index) {
+    int16_t i = entry_find(swap_index);
+    if (i == NO_ENTRY || (entries[i].flags & ZSWAP_CLEAN)) return;
+
+    entries[i].flags |= ZSWAP_CLEAN;
+    dirty_chunks -= entries[i].sectors;
+}
+
+static void entry_copy(int16_t i, uint8_t *data) {
+    int16_t chunk = entries[i].first_chunk;
+    for (uint32_t s = 0; chunk != NO_ENTRY; s++, chunk = chunk_next[chunk]) {
+        memcpy(data + s * SWAP_SECTOR_SIZE, chunk_addr(chunk), SWAP_SECTOR_SIZE);
+    }
+}
+
+/*
+ * Expand the page for swap_index into page if it is in the pool, -1 if not
+ * on_disk tells whether the slot has a copy, if not the caller has to free it
+ */
+int zswap_load(uint32_t swap_index, uint8_t *page, int *on_disk) {
+    static uint8_t data[ZSWAP_MAX_SECTORS * SWAP_SECTOR_SIZE];
+
+    int16_t i = entry_find(swap_index);
+    if (i == NO_ENTRY || (entries[i].flags & ZSWAP_FREED)) return -1;
+
+    entry_copy(i, data);
+    if (swap_unpack_page(data, entries[i].sectors, page)) return -1;
+
+    *on_disk = (entries[i].flags & ZSWAP_CLEAN) != 0;
+
+    /* A clean copy is not needed any more, the rest goes with the slot */
+    if (*on_disk && (entries[i].flags & ZSWAP_WRITEBACK) == 0) entry_remove(i);
+
+    loaded_pages++;
+    return 0;
+}
+
+int zswap_contains(uint32_t swap_index) {
+    int16_t i = entry_find(swap_index);
+    return i != NO_ENTRY && (entries[i].flags & ZSWAP_FREED) == 0;
+}
+
+/*
+ * The slot is being freed, forget its page
+ * Returns 1 if the page is being written back, the slot is then freed once that is done
+ */
+int zswap_drop(uint32_t swap_index) {
+    int16_t i = entry_find(swap_index);
+    if (i == NO_ENTRY) return 0;
+
+    if (entries[i].flags & ZSWAP_WRITEBACK) {
+        chunks_free(i);
+        entries[i].flags |= ZSWAP_FREED;
+        return 1;
+    }
+
+    entry_remove(i);
+    return 0;
+}
+
+/* Oldest page only the pool has, NO_ENTRY if there is none */
+static int16_t oldest_dirty() {
+    for (int16_t i = lru_oldest; i != NO_ENTRY; i = entries[i].lru_prev) {
+        if ((entries[i].flags & (ZSWAP_CLEAN | ZSWAP_WRITEBACK)) == 0) return i;
+    }
+    return NO_ENTRY;
+}
+
+/* Write the oldest pages back to the pagefile while the pool is nearly full, called by the page cleaner */
+void zswap_writeback() {
+    if (!initialised || dirty_chunks <= ZSWAP_WRITEBACK_HIGH) return;
+
+    while (dirty_chunks > ZSWAP_WRITEBACK_LOW) {
+        int16_t i = oldest_dirty();
+        if (i == NO_ENTRY) return;
+
+        uint32_t swap_index = entries[i].swap_index;
+        uint32_t sectors = entries[i].sectors;
+
+        uint8_t *data = malloc(sectors * SWAP_SECTOR_SIZE);
+        if (data == NULL) return;
+        entry_copy(i, data);
+
+        /* Note: The entry stays in the pool for faults while it is written */
+        entries[i].flags |= ZSWAP_WRITEBACK;
+
+        struct uio uio = {
+            .vaddr = (char *) data,
+            .uaddr = NULL,
+            .size = sectors * SWAP_SECTOR_SIZE,
+            .offset = swap_index * SWAP_SECTOR_SIZE,
+            .remaining = sectors * SWAP_SECTOR_SIZE
+        };
+
+        int err = swap_vnode->ops->vop_write(swap_vnode, &uio);
+        free(data);
+
+        entries[i].flags &= (~ZSWAP_WRITEBACK);
+
+        if (entries[i].flags & ZSWAP_FREED) {
+            /* Slot was let go meanwhile, finish freeing it */
+            entry_remove(i);
+            free_swap_index(swap_index);
+            continue;
+        }
+
+        if (err) return;
+
+        /* Safe in the pagefile, make room */
+        entries[i].flags |= ZSWAP_CLEAN;
+        dirty_chunks -= sectors;
+        entry_remove(i);
+        written_back++;
+    }
+}
+
+void zswap_stats(sos_vm_stats_t *stats) {
+    stats->zswap_stored = stored_pages;
+    stats->zswap_loaded = loaded_pages;
+    stats->zswap_written_back = written_back;
+    stats->zswap_pool_pages = pool_pages;
+}
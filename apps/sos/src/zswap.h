@@ -0,0 +1,27 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <cspace/cspace.h>
+#include <sos.h>
+
+#include "swap_bitmap.h"
+
+/* Frames set aside at boot for compressed pages */
+#define ZSWAP_POOL_FRAMES 32
+
+/* Pages that compress worse than this go straight to the pagefile */
+#define ZSWAP_MAX_SECTORS 4
+
+void zswap_init();
+
+int zswap_store(uint32_t swap_index, uint8_t *data, uint32_t sectors);
+void zswap_mark_clean(uint32_t swap_index);
+int zswap_load(uint32_t swap_index, uint8_t *page, int *on_disk);
+int zswap_contains(uint32_t swap_index);
+int zswap_drop(uint32_t swap_index);
+
+void zswap_writeback();
+
+void zswap_stats(sos_vm_stats_t *stats);
+
+#endif /* _ZSWAP_H_ */
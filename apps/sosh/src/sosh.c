@@ -253,6 +253,18 @@ static int kill(int argc, char *argv[]) {
     return sos_process_delete(pid);
 }
 
+static int memlimit(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        printf("Usage: memlimit [pid] frames\n");
+        return 1;
+    }
+
+    if (argc == 2) {
+        return sos_mem_limit(-1, atoi(argv[1]));
+    }
+    return sos_mem_limit(atoi(argv[1]), atoi(argv[2]));
+}
+
 static int benchmark(int argc, char *argv[]) {
     return sos_benchmark();
 }
@@ -342,10 +354,91 @@ static int thrash(int argc, char *argv[]) {
     return 0;
 }
 
+/* Fill a page with zero fill, low entropy or random data depending on i */
+static void swapbench_fill(uint32_t *page, int i) {
+    uint32_t seed = i * 2654435761u + 1;
+    for (int j = 0; j < 1024; j++) {
+        if (i % 3 == 0) {
+            page[j] = (j == 0) ? i : 0;
+        } else if (i % 3 == 1) {
+            page[j] = i * 1024 + j;
+        } else {
+            seed = seed * 1103515245 + 12345;
+            page[j] = seed;
+        }
+    }
+}
+
+static int swapbench(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s npages [frames]\n", argv[0]);
+        return 1;
+    }
+    int pages = atoi(argv[1]);
+    int frames = (argc == 3) ? atoi(argv[2]) : 16;
+
+    uint32_t *buf = malloc(pages * 4096);
+    if (buf == NULL) {
+        printf("%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    /* Keep only a few of our pages resident so the rest go to the pagefile */
+    sos_mem_limit(sos_my_id(), frames);
+
+    sos_vm_stats_t before, after;
+    sos_vm_stats(&before);
+    int64_t start = sos_sys_time_stamp();
+
+    for (int i = 0; i < pages; i++) {
+        swapbench_fill(buf + i * 1024, i);
+    }
+
+    int errors = 0;
+    uint32_t expected[1024];
+    for (int i = 0; i < pages; i++) {
+        swapbench_fill(expected, i);
+        if (memcmp(buf + i * 1024, expected, 4096) != 0) errors++;
+    }
+
+    int64_t elapsed = sos_sys_time_stamp() - start;
+    sos_vm_stats(&after);
+
+    sos_mem_limit(sos_my_id(), 0);
+    free(buf);
+
+    unsigned paged_out = after.pages_out - before.pages_out;
+    unsigned paged_in = after.pages_in - before.pages_in;
+    unsigned bytes = after.bytes_out - before.bytes_out;
+
+    printf("%d pages, %d bad, %lld us\n", pages, errors, elapsed);
+    unsigned writes = after.writes_out - before.writes_out;
+
+    printf("out: %u pages (%u compressed) in %u writes, %u bytes, %u bytes/page, %u us/page\n",
+            paged_out, after.pages_compressed - before.pages_compressed, writes, bytes,
+            paged_out ? bytes / paged_out : 0,
+            paged_out ? (after.swap_out_us - before.swap_out_us) / paged_out : 0);
+    printf("in: %u pages, %u us/page\n", paged_in,
+            paged_in ? (after.swap_in_us - before.swap_in_us) / paged_in : 0);
+    printf("readahead: %u pages, %u hits, %u wasted, window %u\n",
+            after.readahead_pages - before.readahead_pages,
+            after.readahead_hits - before.readahead_hits,
+            after.readahead_wasted - before.readahead_wasted,
+            after.readahead_window);
+    printf("zswap: %u stored, %u loaded, %u written back, %u in pool\n",
+            after.zswap_stored - before.zswap_stored,
+            after.zswap_loaded - before.zswap_loaded,
+            after.zswap_written_back - before.zswap_written_back,
+            after.zswap_pool_pages);
+
+    return errors ? 1 : 0;
+}
+
 struct command commands[] = { { "dir", dir }, { "ls", dir }, { "cat", cat }, {
         "cp", cp }, { "ps", ps }, { "exec", exec }, {"sleep",second_sleep}, {"msleep",milli_sleep},
         {"time", second_time}, {"mtime", micro_time}, {"kill", kill},
-        {"benchmark", benchmark}, {"thrash", thrash}};
+        {"benchmark", benchmark}, {"thrash", thrash}, {"memlimit", memlimit},
+        {"swapbench", swapbench}};
 
 int main(void) {
     char buf[BUF_SIZ];
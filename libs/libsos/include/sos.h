@@ -81,6 +81,25 @@ typedef struct {
   char      command[N_NAME];    /* Name of exectuable */
 } sos_process_t;
 
+/* Every field is a word, they are returned in message registers */
+typedef struct {
+  unsigned  pages_out;         /* pages written to the pagefile */
+  unsigned  pages_compressed;  /* of those, pages stored compressed */
+  unsigned  bytes_out;         /* pagefile bytes written for them */
+  unsigned  writes_out;        /* pagefile writes they were batched into */
+  unsigned  swap_out_us;       /* total time spent writing them */
+  unsigned  pages_in;          /* pages read back from the pagefile */
+  unsigned  swap_in_us;        /* total time spent reading them */
+  unsigned  readahead_pages;   /* pages read ahead into the swap cache */
+  unsigned  readahead_hits;    /* faults served from the swap cache */
+  unsigned  readahead_wasted;  /* pages dropped from it unused */
+  unsigned  readahead_window;  /* pages currently read ahead of a fault */
+  unsigned  zswap_stored;      /* pages kept in the compressed pool */
+  unsigned  zswap_loaded;      /* faults served from it */
+  unsigned  zswap_written_back; /* pages it wrote back to the pagefile */
+  unsigned  zswap_pool_pages;  /* pages in it now */
+} sos_vm_stats_t;
+
 /* I/O system calls */
 
 int sos_sys_open(const char *path, fmode_t mode);
@@ -132,6 +151,13 @@ int sos_process_delete(pid_t pid);
  * Returns 0 if successful, -1 otherwise (invalid process).
  */
 
+pid_t sos_process_fork(void);
+/* Create a copy of the calling process. Memory is shared copy-on-write.
+ * Mappings of a file made by sos_mmap with FM_WRITE are not inherited.
+ * Returns ID of the new process in the parent, 0 in the child and -1 if
+ * error.
+ */
+
 pid_t sos_my_id(void);
 /* Returns ID of caller's process. */
 
@@ -173,4 +199,45 @@ int sos_share_vm(void *adr, size_t size, int writable);
  * Returns 0 if successful, -1 otherwise (invalid address or size).
  */
 
+int sos_mem_limit(pid_t pid, size_t frames);
+/* Limit the frames process "pid" may keep resident to "frames", beyond
+ * that its own pages are paged out as it faults and it is the first to
+ * lose memory under pressure. If "pid" is -1, set the frame budget of the
+ * whole system instead, raised if needed to what SOS cannot page out plus
+ * the pager's headroom. A limit of 0 removes the limit.
+ * Only the process itself or its parent may limit it, to at least 8 frames.
+ * Returns 0 if successful, -1 otherwise (invalid process, not allowed or
+ * limit too low).
+ */
+
+int sos_vm_stats(sos_vm_stats_t *stats);
+/* Returns through "stats" the paging counters since booting.
+ * Returns 0 if successful.
+ */
+
+void *sos_mmap(int file, size_t offset, size_t len, int prot);
+/* Map "len" bytes of open file "file" from "offset" into the address
+ * space. "prot" is FM_READ, optionally with FM_WRITE, and the file must
+ * be open for the same. "offset" must be divisible by the page size.
+ * Pages are read from the file as they are first touched. Pages written
+ * to go back to the file, not the pagefile, when they are paged out or
+ * through sos_msync and sos_munmap.
+ * If "file" is -1 the mapping is anonymous and reads as zero until written.
+ * Returns the address of the mapping if successful, (void *) -1 otherwise.
+ */
+
+int sos_munmap(void *adr, size_t len);
+/* Remove ["adr","adr"+"len") from a mapping made by sos_mmap, writing
+ * its written pages back to the file first. "adr" must be divisible by
+ * the page size and the range must lie within a single mapping, the rest
+ * of the mapping stays mapped. Its frames and pagefile slots are freed.
+ * Returns 0 if successful, -1 otherwise (not within a mapping).
+ */
+
+int sos_msync(void *adr, size_t len);
+/* Write the pages of ["adr","adr"+"len") of a mapping made by sos_mmap
+ * that were written to since they were read back to the file.
+ * Returns 0 if successful, -1 otherwise (not a mapping or write failed).
+ */
+
 #endif
@@ -32,6 +32,13 @@
 #define SOS_PROCESS_ID_SYSCALL 11
 #define SOS_PROCESS_WAIT_SYSCALL 12
 #define SOS_PROCESS_STATUS_SYSCALL 13
+#define SOS_SHARE_VM_SYSCALL 14
+#define SOS_PROCESS_FORK_SYSCALL 15
+#define SOS_MEM_LIMIT_SYSCALL 16
+#define SOS_VM_STATS_SYSCALL 17
+#define SOS_MMAP_SYSCALL 18
+#define SOS_MUNMAP_SYSCALL 19
+#define SOS_MSYNC_SYSCALL 20
 
 int sos_sys_open(const char *path, fmode_t mode) {
     int numRegs = 3;
@@ -270,6 +277,129 @@ int sos_brk(uintptr_t newbrk) {
     return seL4_GetMR(0);
 }
 
+int sos_share_vm(void *adr, size_t size, int writable) {
+    int numRegs = 4;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_SHARE_VM_SYSCALL);
+    /* Set region to share */
+    seL4_SetMR(1, (seL4_Word) adr);
+    seL4_SetMR(2, size);
+    /* Set whether other processes may write */
+    seL4_SetMR(3, writable);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return error code */
+    return seL4_GetMR(0);
+}
+
+pid_t sos_process_fork(void) {
+    int numRegs = 1;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_PROCESS_FORK_SYSCALL);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return child pid (0 in the child) / err */
+    return seL4_GetMR(0);
+}
+
+int sos_mem_limit(pid_t pid, size_t frames) {
+    int numRegs = 3;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_MEM_LIMIT_SYSCALL);
+    /* Set whose limit and the new limit */
+    seL4_SetMR(1, pid);
+    seL4_SetMR(2, frames);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return error code */
+    return seL4_GetMR(0);
+}
+
+int sos_vm_stats(sos_vm_stats_t *stats) {
+    int numRegs = 1;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_VM_STATS_SYSCALL);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Counters come back one per register */
+    seL4_Word *words = (seL4_Word *) stats;
+    for (int i = 0; i < sizeof(sos_vm_stats_t) / sizeof(seL4_Word); i++) {
+        words[i] = seL4_GetMR(i);
+    }
+
+    return 0;
+}
+
+void *sos_mmap(int file, size_t offset, size_t len, int prot) {
+    int numRegs = 5;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_MMAP_SYSCALL);
+    /* Set part of the file to map */
+    seL4_SetMR(1, file);
+    seL4_SetMR(2, offset);
+    seL4_SetMR(3, len);
+    /* Set access to the mapping */
+    seL4_SetMR(4, prot);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return address of the mapping / err */
+    return (void *) seL4_GetMR(0);
+}
+
+int sos_munmap(void *adr, size_t len) {
+    int numRegs = 3;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_MUNMAP_SYSCALL);
+    /* Set mapping to remove */
+    seL4_SetMR(1, (seL4_Word) adr);
+    seL4_SetMR(2, len);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return error code */
+    return seL4_GetMR(0);
+}
+
+int sos_msync(void *adr, size_t len) {
+    int numRegs = 3;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, numRegs);
+    seL4_SetTag(tag);
+
+    /* Set syscall number */
+    seL4_SetMR(0, SOS_MSYNC_SYSCALL);
+    /* Set range to write back */
+    seL4_SetMR(1, (seL4_Word) adr);
+    seL4_SetMR(2, len);
+
+    seL4_Call(SOS_IPC_EP_CAP, tag);
+
+    /* Return error code */
+    return seL4_GetMR(0);
+}
+
 size_t sos_write(void *vData, size_t count) {
     return sos_sys_write(STDOUT_FD, vData, count);
 }
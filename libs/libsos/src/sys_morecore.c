@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <sel4/types.h>
+#include <sos.h>
 
 #define PROCESS_HEAP_START  (0x20000000)
 #define PROCESS_HEAP_END    (0x60000000)
@@ -37,10 +38,13 @@ sys_brk(va_list ap)
     /*if the newbrk is 0, return the bottom of the heap*/
     if (!newbrk) {
         ret = morecore_base;
-    } else if (newbrk > morecore_base &&
+    } else if (newbrk >= PROCESS_HEAP_START &&
                newbrk < morecore_top) {
+        /* Lowering the break gives the pages past it back to SOS */
+        if (sos_brk(newbrk)) {
+            return 0;
+        }
         ret = morecore_base = newbrk;
-        sos_brk(ret);
     } else {
         ret = 0;
     }
@@ -48,8 +52,8 @@ sys_brk(va_list ap)
     return ret;
 }
 
-/* Large mallocs will result in muslc calling mmap, so we do a minimal implementation
-   here to support that. We make a bunch of assumptions in the process */
+/* Large mallocs will result in muslc calling mmap, each mapping gets a region
+   of its own in SOS so munmap can give its memory back */
 long
 sys_mmap2(va_list ap)
 {
@@ -58,22 +62,47 @@ sys_mmap2(va_list ap)
     int prot = va_arg(ap, int);
     int flags = va_arg(ap, int);
     int fd = va_arg(ap, int);
-    off_t offset = va_arg(ap, off_t);
+    long pgoffset = va_arg(ap, long); /* In pages */
     (void)addr;
-    (void)prot;
-    (void)fd;
-    (void)offset;
+
+    /* SOS picks the address, and shares file pages with the file */
+    if (flags & MAP_FIXED) {
+        return -EINVAL;
+    }
+    if (!(flags & MAP_ANONYMOUS) && !(flags & MAP_SHARED)) {
+        return -EINVAL;
+    }
+
+    int mode = 0;
+    if (prot & PROT_READ) {
+        mode |= FM_READ;
+    }
+    if (prot & PROT_WRITE) {
+        mode |= FM_READ | FM_WRITE;
+    }
+
     if (flags & MAP_ANONYMOUS) {
-        /* Steal from the top */
-        uintptr_t base = morecore_top - length;
-        if (base < morecore_base) {
-            return -ENOMEM;
-        }
-        morecore_top = base;
-        return base;
+        fd = -1;
+        pgoffset = 0;
     }
-    assert(!"not implemented");
-    return -ENOMEM;
+
+    void *base = sos_mmap(fd, (size_t) pgoffset << 12, length, mode);
+    if (base == (void *) -1) {
+        return -ENOMEM;
+    }
+    return (long) base;
+}
+
+long
+sys_munmap(va_list ap)
+{
+    void *addr = va_arg(ap, void*);
+    size_t length = va_arg(ap, size_t);
+
+    if (sos_munmap(addr, length)) {
+        return -EINVAL;
+    }
+    return 0;
 }
 
 long
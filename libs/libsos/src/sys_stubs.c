@@ -453,11 +453,6 @@ long sys_mmap(va_list ap)
     assert(!"sys_mmap not implemented");
     return 0;
 }
-long sys_munmap(va_list ap)
-{
-    assert(!"sys_munmap not implemented");
-    return 0;
-}
 long sys_truncate(va_list ap)
 {
     assert(!"sys_truncate not implemented");
@@ -2022,11 +2017,6 @@ long sys_reboot(va_list ap)
     assert(!"sys_reboot not implemented");
     return 0;
 }
-long sys_munmap(va_list ap)
-{
-    assert(!"sys_munmap not implemented");
-    return 0;
-}
 long sys_truncate(va_list ap)
 {
     assert(!"sys_truncate not implemented");